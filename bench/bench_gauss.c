@@ -0,0 +1,87 @@
+/*
+	Normal sampling microbenchmark
+	Compares the cost and the moments of N-distributed wire values drawn with the
+	ziggurat batches against the previous Marsaglia polar method.
+
+	Usage: bench_gauss [samples]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../includes/wf_markov.h"
+#include "../includes/wf_random.h"
+#include "../includes/wf_time.h"
+
+#define DEFAULT_SAMPLES 10000000
+
+
+typedef struct {
+	double sum, sum2, sum3, sum4;
+	long tail2, tail3, tail4; // Samples beyond 2, 3 and 4 standard deviations
+} Moments;
+
+/* Previous implementation of N-distributed values */
+static double polarValue(const WireValue *wv, Random *rng) {
+	double x, y, r2;
+
+	do {
+		x = (2*randomUniform(rng)) - 1;
+		y = (2*randomUniform(rng)) - 1;
+		r2 = x*x + y*y;
+	} while (r2 >= 1.0);
+
+	return wv->value + ( wv->plus * SIGMA * x * sqrt( (-2 * log(r2)) / r2 ) );
+}
+
+static void addSample(Moments *m, const double x) {
+	m->sum += x; m->sum2 += x*x; m->sum3 += x*x*x; m->sum4 += x*x*x*x;
+	if (fabs(x) > 2) { m->tail2++; }
+	if (fabs(x) > 3) { m->tail3++; }
+	if (fabs(x) > 4) { m->tail4++; }
+}
+
+static void printMoments(const char *name, const Moments *m, const long n, const double ns) {
+	double mean = m->sum / n;
+	double var = m->sum2 / n - mean*mean;
+	double skew = (m->sum3 / n - 3*mean*var - mean*mean*mean) / pow(var, 1.5);
+	double kurt = (m->sum4 / n - 4*mean*m->sum3 / n + 6*mean*mean*m->sum2 / n - 3*mean*mean*mean*mean) / (var*var);
+
+	printf("%-8s %8.2f %9.5f %9.5f %9.5f %9.5f %10.3e %10.3e %10.3e\n", name, ns, mean, var, skew, kurt,
+			(double)m->tail2 / n, (double)m->tail3 / n, (double)m->tail4 / n);
+}
+
+int main(int argc, char *argv[]) {
+	long samples = (argc > 1) ? atol(argv[1]) : DEFAULT_SAMPLES;
+	// Standardized: value 0, plus 1/SIGMA
+	WireValue wv = { .value = 0, .plus = 1 / SIGMA, .algorithm = ALGO_GAUSS_NORMAL };
+	Moments polar = { 0 }, ziggurat = { 0 };
+	Random rng;
+	uint64_t start;
+	double x;
+
+	randomInit(&rng, 1, 0);
+	sampleWireValue(&wv, &rng); // Builds the tables
+
+	printf("%-8s %8s %9s %9s %9s %9s %10s %10s %10s\n", "method", "ns", "mean", "var", "skew", "kurt", "P(|x|>2)", "P(|x|>3)", "P(|x|>4)");
+	printf("%-8s %8s %9.5f %9.5f %9.5f %9.5f %10.3e %10.3e %10.3e\n", "exact", "", 0.0, 1.0, 0.0, 3.0, erfc(2/M_SQRT2), erfc(3/M_SQRT2), erfc(4/M_SQRT2));
+
+	start = now_ns();
+	for (long i=0; i<samples; i++) { x = polarValue(&wv, &rng); addSample(&polar, x); }
+	printMoments("polar", &polar, samples, (double)(now_ns() - start) / samples);
+
+	start = now_ns();
+	for (long i=0; i<samples; i++) { x = sampleWireValue(&wv, &rng); addSample(&ziggurat, x); }
+	printMoments("ziggurat", &ziggurat, samples, (double)(now_ns() - start) / samples);
+
+	// Sampling cost only
+	double sink = 0;
+	start = now_ns();
+	for (long i=0; i<samples; i++) { sink += polarValue(&wv, &rng); }
+	double polar_ns = (double)(now_ns() - start) / samples;
+	start = now_ns();
+	for (long i=0; i<samples; i++) { sink += sampleWireValue(&wv, &rng); }
+	double ziggurat_ns = (double)(now_ns() - start) / samples;
+	printf("\nsampling only: polar %.2f ns, ziggurat %.2f ns (%.1fx) [%g]\n", polar_ns, ziggurat_ns, polar_ns / ziggurat_ns, sink);
+
+	return 0;
+}
@@ -0,0 +1,111 @@
+/*
+	Markov transition microbenchmark
+	Compares the cost of a state change with the alias tables against
+	the linear walk of a dense adjacency row (the previous implementation),
+	for sparse chains of increasing size.
+
+	Usage: bench_markov [steps] [edges per node]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../includes/wf_conn.h"
+#include "../includes/wf_markov.h"
+#include "../includes/wf_random.h"
+#include "../includes/wf_time.h"
+
+#define DEFAULT_STEPS 1000000
+#define DEFAULT_DEGREE 8
+#define MAX_DENSE_NODES 4096 // Larger dense maps are not allocated
+
+static const int sizes[] = { 16, 256, 1024, 4096, 20000, 100000 };
+
+
+/* Previous implementation: walks the dense row as a CDF starting from the node */
+static int cdfStep(const double *adjacency, const int n, Random *rng, const int start_node) {
+	double probability = randomUniform(rng) * 100;
+	int new_node = 0;
+
+	for (int j=0; j<n; j++) {
+		new_node = (start_node + j) % n;
+		double change_probability = adjacency[(size_t)start_node*n + new_node];
+
+		if (change_probability >= probability) { break; }
+		probability -= change_probability;
+	}
+
+	return new_node;
+}
+
+/* Connects every node to degree random nodes, with the same weight as the loopback edge */
+static double *setRandomEdges(struct vde_wirefilter_conn *vde_conn, const int n, const int degree) {
+	double weight = 100.0 / (degree + 1);
+	double *adjacency = (n <= MAX_DENSE_NODES) ? calloc((size_t)n*n, sizeof(double)) : NULL;
+	char *edges = malloc((size_t)n * degree * 40);
+	Random rng;
+	int len = 0;
+
+	if (edges == NULL) { exit(1); }
+	randomInit(&rng, 7, 0);
+
+	for (int i=0; i<n; i++) {
+		if (adjacency) { adjacency[(size_t)i*n + i] = 100.0; }
+
+		for (int d=0; d<degree; d++) {
+			int j = (int)(randomUniform(&rng) * n);
+			if (j == i || (adjacency && adjacency[(size_t)i*n + j] != 0)) { continue; }
+
+			len += sprintf(edges + len, "%d,%d,%f ", i, j, weight);
+			if (adjacency) {
+				adjacency[(size_t)i*n + j] = weight;
+				adjacency[(size_t)i*n + i] -= weight;
+			}
+		}
+	}
+	edges[len] = '\0';
+
+	uint64_t start = now_ns();
+	markovSetEdges(vde_conn, edges);
+	printf("%8d %12.1f", n, NS_TO_MS((double)(now_ns() - start)));
+
+	free(edges);
+	return adjacency;
+}
+
+int main(int argc, char *argv[]) {
+	long steps = (argc > 1) ? atol(argv[1]) : DEFAULT_STEPS;
+	int degree = (argc > 2) ? atoi(argv[2]) : DEFAULT_DEGREE;
+	volatile int sink = 0;
+
+	printf("%8s %12s %14s %14s\n", "nodes", "setedge ms", "cdf ns/step", "alias ns/step");
+
+	for (unsigned int s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) {
+		int n = sizes[s];
+		struct vde_wirefilter_conn *vde_conn = calloc(1, sizeof(struct vde_wirefilter_conn));
+		if (vde_conn == NULL || initMarkov(vde_conn, n, 0, 0) < 0) { return 1; }
+		initRandom(vde_conn, 1);
+		double *adjacency = setRandomEdges(vde_conn, n, degree);
+
+		if (adjacency) {
+			int node = 0;
+			uint64_t start = now_ns();
+			for (long i=0; i<steps; i++) { node = cdfStep(adjacency, n, &vde_conn->random.markov, node); }
+			printf(" %14.1f", (double)(now_ns() - start) / steps);
+			sink += node;
+			free(adjacency);
+		}
+		else {
+			printf(" %14s", "-");
+		}
+
+		uint64_t start = now_ns();
+		for (long i=0; i<steps; i++) { markovStep(vde_conn, vde_conn->markov.current_node); }
+		printf(" %14.1f\n", (double)(now_ns() - start) / steps);
+		sink += vde_conn->markov.current_node;
+
+		closeMarkov(vde_conn);
+		free(vde_conn);
+	}
+
+	return 0;
+}
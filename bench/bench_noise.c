@@ -0,0 +1,87 @@
+/*
+	Noise microbenchmark
+	Compares the per-packet cost and the mean number of broken bits of the
+	binomial draw against the previous loop (one uniform for each broken bit
+	to count them, and another one to choose each position).
+
+	Usage: bench_noise [packets] [packet length]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "../includes/wf_markov.h"
+#include "../includes/wf_random.h"
+#include "../includes/wf_time.h"
+
+#define DEFAULT_PACKETS 1000000
+#define DEFAULT_LEN 1500
+#define FLIP_BATCH 32
+
+static const double noises[] = { 10, 100, 1000, 10000, 100000, 500000 };
+
+
+/* Previous implementation, returns the number of broken bits */
+static unsigned int loopNoise(Random *rng, unsigned char *buf, const unsigned int len, const double noise) {
+	unsigned int broken_bits = 0;
+
+	while ((randomUniform(rng)*8*MEGA) < (len-2)*8*noise) { broken_bits++; }
+
+	for (unsigned int i=0; i<broken_bits; i++) {
+		int to_flip_bit = randomUniform(rng) * (len-2)*8;
+		buf[to_flip_bit >> 3] ^= 1<<(to_flip_bit & 0x7);
+	}
+
+	return broken_bits;
+}
+
+static unsigned int binomialNoise(Random *rng, unsigned char *buf, const unsigned int len, const double noise) {
+	uint32_t bits = len * 8;
+	uint32_t to_flip[FLIP_BATCH];
+	unsigned int broken_bits = randomBinomial(rng, bits, NOISE_BIT_PROBABILITY(noise));
+
+	for (unsigned int left = broken_bits; left > 0; ) {
+		unsigned int count = (left < FLIP_BATCH) ? left : FLIP_BATCH;
+		randomIndexes(rng, to_flip, count, bits);
+		for (unsigned int i=0; i<count; i++) { buf[to_flip[i] >> 3] ^= 1 << (to_flip[i] & 0x7); }
+		left -= count;
+	}
+
+	return broken_bits;
+}
+
+int main(int argc, char *argv[]) {
+	long packets = (argc > 1) ? atol(argv[1]) : DEFAULT_PACKETS;
+	unsigned int len = (argc > 2) ? (unsigned int)atoi(argv[2]) : DEFAULT_LEN;
+	unsigned char *buf = calloc(len, 1);
+	Random rng;
+
+	if (buf == NULL || len < 3) { return 1; }
+	randomInit(&rng, 1, 0);
+
+	printf("%10s %10s %12s %12s %12s %12s\n", "noise", "expected", "loop bits", "loop ns", "binom bits", "binom ns");
+
+	for (unsigned int n=0; n<sizeof(noises)/sizeof(noises[0]); n++) {
+		double noise = noises[n];
+		double expected = len * 8 * NOISE_BIT_PROBABILITY(noise);
+		uint64_t total = 0, start;
+
+		printf("%10.0f %10.3f", noise, expected);
+
+		// The old loop never ends when each packet is expected to have a broken bit
+		if ((len-2)*8*noise < 8*MEGA) {
+			start = now_ns();
+			for (long i=0; i<packets; i++) { total += loopNoise(&rng, buf, len, noise); }
+			printf(" %12.3f %12.1f", (double)total / packets, (double)(now_ns() - start) / packets);
+		}
+		else {
+			printf(" %12s %12s", "-", "-");
+		}
+
+		total = 0;
+		start = now_ns();
+		for (long i=0; i<packets; i++) { total += binomialNoise(&rng, buf, len, noise); }
+		printf(" %12.3f %12.1f\n", (double)total / packets, (double)(now_ns() - start) / packets);
+	}
+
+	free(buf);
+	return 0;
+}
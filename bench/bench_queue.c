@@ -0,0 +1,269 @@
+/*
+	Delay queue microbenchmark and stress test
+	Drives enqueue/dequeue of each queue engine as the packet handler does: bursts of packets are
+	queued with a delay drawn from a distribution, then the packets that are due are released.
+	The (virtual) arrival rate is set so that the mean backlog is the requested one.
+	A burst filling the empty queue with the whole backlog at once is timed as well, then drained.
+	Every run checks that each packet is released once, not before its forward time,
+	in forward time order (arrival order for the FIFO queue), and that the queue accounting
+	is back to zero when drained. The jitter delays (a tick of the timing wheel around the mean)
+	make the packets due in the same tick of the wheel arrive out of order.
+
+	Usage: bench_queue [packets] [backlog...]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <math.h>
+#include "../includes/wf_conn.h"
+#include "../includes/wf_queue.h"
+#include "../includes/wf_random.h"
+#include "../includes/wf_time.h"
+
+#define DEFAULT_PACKETS 1000000
+#define PACKET_SIZE 100
+#define SEND_BURST 32
+#define PACKET_CHUNK 4096 // Packet headers allocated each time the store grows
+#define MEAN_DELAY_NS MS_TO_NS(10)
+
+static const unsigned int default_backlogs[] = { 1000, 100000, 1000000 };
+
+static const struct {
+	const char *name;
+	char fifoness;
+	char engine;
+} engines[] = {
+	{ "heap", NO_FIFO, QUEUE_HEAP },
+	{ "wheel", NO_FIFO, QUEUE_WHEEL },
+	{ "fifo", FIFO, QUEUE_HEAP },
+};
+
+enum { DELAY_CONSTANT, DELAY_UNIFORM, DELAY_NORMAL, DELAY_PARETO, DELAY_JITTER, DELAY_DISTRIBUTIONS };
+static const char *distribution_names[DELAY_DISTRIBUTIONS] = { "constant", "uniform", "normal", "pareto", "jitter" };
+
+
+/* Delays with a mean of MEAN_DELAY_NS */
+static uint64_t randomDelay(Random *rng, const int distribution) {
+	double delay;
+
+	switch (distribution) {
+		case DELAY_UNIFORM: delay = 2 * MEAN_DELAY_NS * randomUniform(rng); break;
+		case DELAY_NORMAL: delay = MEAN_DELAY_NS + 0.2 * MEAN_DELAY_NS * randomNormal(rng); break;
+		case DELAY_PARETO:
+			// Heavy tail (alpha 1.5), capped at 100 times the mean
+			delay = (MEAN_DELAY_NS / 3.0) / pow(1 - randomUniform(rng), 1 / 1.5);
+			if (delay > 100.0 * MEAN_DELAY_NS) { delay = 100.0 * MEAN_DELAY_NS; }
+			break;
+		case DELAY_JITTER: delay = MEAN_DELAY_NS + WHEEL_DEFAULT_TICK_NS * (randomUniform(rng) - 0.5); break;
+		default: delay = MEAN_DELAY_NS;
+	}
+
+	return (delay > 0) ? (uint64_t)delay : 0;
+}
+
+
+/*
+	Packet headers (without payload), recycled through a free list.
+	The flags of a packet hold the index of its PacketInfo.
+*/
+typedef struct {
+	uint64_t forward_time; // Requested forward time
+	uint64_t seq; // Arrival order
+	char queued;
+} PacketInfo;
+
+typedef struct {
+	char **slabs;
+	unsigned int slab_count;
+	PacketInfo *info;
+	Packet *free_list;
+} PacketStore;
+
+static Packet *getPacket(PacketStore *store) {
+	if (store->free_list == NULL) {
+		char *slab = malloc(PACKET_CHUNK * sizeof(Packet));
+		store->slabs = realloc(store->slabs, (store->slab_count + 1) * sizeof(char *));
+		store->info = realloc(store->info, (size_t)(store->slab_count + 1) * PACKET_CHUNK * sizeof(PacketInfo));
+		if (slab == NULL || store->slabs == NULL || store->info == NULL) { fprintf(stderr, "Packet store malloc error\n"); exit(1); }
+
+		for (int i=PACKET_CHUNK-1; i>=0; i--) {
+			Packet *packet = (Packet *)(slab + i*sizeof(Packet));
+			packet->len = PACKET_SIZE;
+			packet->direction = LEFT_TO_RIGHT;
+			packet->flags = store->slab_count * PACKET_CHUNK + i;
+			packet->next = store->free_list;
+			store->free_list = packet;
+		}
+		store->slabs[store->slab_count++] = slab;
+	}
+
+	Packet *packet = store->free_list;
+	store->free_list = packet->next;
+	return packet;
+}
+
+static void putPacket(PacketStore *store, Packet *packet) {
+	packet->next = store->free_list;
+	store->free_list = packet;
+}
+
+static void freeStore(PacketStore *store) {
+	for (unsigned int i=0; i<store->slab_count; i++) { free(store->slabs[i]); }
+	free(store->slabs);
+	free(store->info);
+}
+
+
+/* State of a run, for the invariant checks */
+typedef struct {
+	char fifoness;
+	uint64_t sent;
+	uint64_t released;
+	uint64_t last_forward_time;
+	uint64_t last_seq;
+	unsigned int max_backlog;
+	uint64_t errors;
+} RunState;
+
+/* Only the first violation of a run is printed */
+static void checkError(RunState *run, const char *format, ...) {
+	va_list args;
+
+	if (run->errors++ == 0) {
+		va_start(args, format);
+		vfprintf(stderr, format, args);
+		va_end(args);
+		fprintf(stderr, "\n");
+	}
+}
+
+static void queuePacket(struct vde_wirefilter_conn *vde_conn, PacketStore *store, RunState *run, const uint64_t forward_time) {
+	Packet *packet = getPacket(store);
+	PacketInfo *info = &store->info[packet->flags];
+
+	info->forward_time = forward_time;
+	info->seq = run->sent++;
+	info->queued = 1;
+	enqueue(vde_conn, packet, forward_time);
+
+	unsigned int size = vde_conn->queue.dir[LEFT_TO_RIGHT].size;
+	if (size > run->max_backlog) { run->max_backlog = size; }
+}
+
+static void releasePacket(PacketStore *store, RunState *run, Packet *packet, const uint64_t now) {
+	PacketInfo *info = &store->info[packet->flags];
+
+	if (!info->queued) { checkError(run, "packet %" PRIu64 " released twice", info->seq); }
+	if (info->forward_time > now) { checkError(run, "packet due at %" PRIu64 " released at %" PRIu64, info->forward_time, now); }
+
+	if (run->fifoness == FIFO) {
+		if (run->released > 0 && info->seq != run->last_seq + 1) { checkError(run, "packet %" PRIu64 " released after packet %" PRIu64, info->seq, run->last_seq); }
+	}
+	else if (info->forward_time < run->last_forward_time) {
+		checkError(run, "forward time %" PRIu64 " released after %" PRIu64, info->forward_time, run->last_forward_time);
+	}
+
+	run->last_forward_time = info->forward_time;
+	run->last_seq = info->seq;
+	run->released++;
+	info->queued = 0;
+	putPacket(store, packet);
+}
+
+/* Releases the packets due at now */
+static void releaseDue(struct vde_wirefilter_conn *vde_conn, PacketStore *store, RunState *run, const uint64_t now) {
+	DelayQueue *queue = &vde_conn->queue.dir[LEFT_TO_RIGHT];
+
+	while (queue->size > 0 && nextQueueTime(vde_conn, LEFT_TO_RIGHT) <= now) {
+		releasePacket(store, run, dequeue(vde_conn, LEFT_TO_RIGHT), now);
+	}
+}
+
+static void checkEmpty(struct vde_wirefilter_conn *vde_conn, RunState *run) {
+	DelayQueue *queue = &vde_conn->queue.dir[LEFT_TO_RIGHT];
+
+	if (run->released != run->sent) { checkError(run, "%" PRIu64 " packets released out of %" PRIu64, run->released, run->sent); }
+	if (queue->size != 0 || queue->byte_size != 0) { checkError(run, "drained queue of %u packets and %u bytes", queue->size, queue->byte_size); }
+}
+
+
+static int runBenchmark(const int e, const int distribution, const unsigned int backlog, const uint64_t packets) {
+	struct vde_wirefilter_conn *vde_conn = calloc(1, sizeof(struct vde_wirefilter_conn));
+	uint64_t *delays = malloc(packets * sizeof(uint64_t));
+	PacketStore store = { 0 };
+	RunState run = { .fifoness=engines[e].fifoness };
+	Random rng;
+
+	if (vde_conn == NULL || delays == NULL || backlog == 0) { return -1; }
+	if (initQueue(vde_conn, engines[e].fifoness, engines[e].engine, 0) < 0) { return -1; }
+
+	randomInit(&rng, 7, distribution);
+	for (uint64_t i=0; i<packets; i++) { delays[i] = randomDelay(&rng, distribution); }
+
+	// Virtual clock, starting from the present as the timing wheel does
+	double interarrival_ns = (double)MEAN_DELAY_NS / backlog;
+	uint64_t base = now_ns();
+	uint64_t now = base;
+
+	uint64_t start = now_ns();
+	while (run.sent < packets) {
+		for (int i=0; i<SEND_BURST && run.sent < packets; i++) {
+			queuePacket(vde_conn, &store, &run, now + delays[run.sent]);
+		}
+		now = base + (uint64_t)(run.sent * interarrival_ns);
+		releaseDue(vde_conn, &store, &run, now);
+	}
+	while (vde_conn->queue.dir[LEFT_TO_RIGHT].size > 0) {
+		now = nextQueueTime(vde_conn, LEFT_TO_RIGHT);
+		releaseDue(vde_conn, &store, &run, now);
+	}
+	double run_s = (now_ns() - start) / 1e9;
+	checkEmpty(vde_conn, &run);
+
+	// Whole backlog at once into the (idle) queue
+	uint64_t fill_start = now_ns();
+	for (unsigned int i=0; i<backlog; i++) {
+		queuePacket(vde_conn, &store, &run, now + delays[i % packets]);
+	}
+	uint64_t drain_start = now_ns();
+	releaseDue(vde_conn, &store, &run, UINT64_MAX);
+	uint64_t drain_end = now_ns();
+	checkEmpty(vde_conn, &run);
+
+	printf("%-6s %-9s %8u %8u %12.2f %12.1f %12.1f %8s\n", engines[e].name, distribution_names[distribution], backlog, run.max_backlog,
+			packets / run_s / 1e6, (double)(drain_start - fill_start) / backlog, (double)(drain_end - drain_start) / backlog,
+			run.errors ? "FAIL" : "ok");
+	fflush(stdout);
+
+	closeQueue(vde_conn);
+	freeStore(&store);
+	free(delays);
+	free(vde_conn);
+
+	return run.errors ? -1 : 0;
+}
+
+
+int main(int argc, char *argv[]) {
+	uint64_t packets = (argc > 1) ? strtoull(argv[1], NULL, 10) : DEFAULT_PACKETS;
+	int failed = 0;
+
+	if (packets == 0) { fprintf(stderr, "Usage: %s [packets] [backlog...]\n", argv[0]); return 1; }
+
+	printf("%-6s %-9s %8s %8s %12s %12s %12s %8s\n", "engine", "delay", "backlog", "max", "run Mpkt/s", "fill ns/pkt", "drain ns/pkt", "check");
+
+	for (unsigned int e=0; e<sizeof(engines)/sizeof(engines[0]); e++) {
+		for (int d=0; d<DELAY_DISTRIBUTIONS; d++) {
+			if (argc > 2) {
+				for (int b=2; b<argc; b++) { failed |= runBenchmark(e, d, strtoul(argv[b], NULL, 10), packets); }
+			}
+			else {
+				for (unsigned int b=0; b<sizeof(default_backlogs)/sizeof(default_backlogs[0]); b++) { failed |= runBenchmark(e, d, default_backlogs[b], packets); }
+			}
+		}
+	}
+
+	return failed ? 1 : 0;
+}
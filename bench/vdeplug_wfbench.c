@@ -0,0 +1,127 @@
+/*
+	In-process nested VNL for the benchmarks.
+	wfbench:// gives back (as received packets) the packets sent to it, wfbench://null discards them.
+	Packets are handed over through rings of preallocated buffers, so the nested side costs
+	no allocation and no syscall but the doorbell.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libvdeplug.h>
+#include <libvdeplug_mod.h>
+#include "../includes/wf_ring.h"
+
+#define WFBENCH_BUFFERS 4096 // Packets in flight in the loopback
+
+uint64_t wfbench_dropped; // Packets sent when all the buffers were waiting to be received (read by wf_bench)
+
+
+static VDECONN *wfbench_open(char *vde_url, char *descr, int interface_version, struct vde_open_args *open_args);
+static ssize_t wfbench_recv(VDECONN *conn, void *buf, size_t len, int flags);
+static ssize_t wfbench_send(VDECONN *conn, const void *buf, size_t len, int flags);
+static int wfbench_datafd(VDECONN *conn);
+static int wfbench_ctlfd(VDECONN *conn);
+static int wfbench_close(VDECONN *conn);
+
+struct vdeplug_module vdeplug_ops = {
+	.vde_open_real = wfbench_open,
+	.vde_recv = wfbench_recv,
+	.vde_send = wfbench_send,
+	.vde_datafd = wfbench_datafd,
+	.vde_ctlfd = wfbench_ctlfd,
+	.vde_close = wfbench_close
+};
+
+
+typedef struct {
+	size_t len;
+	unsigned char data[VDE_ETHBUFSIZE];
+} Buffer;
+
+struct wfbench_conn {
+	void *handle;
+	struct vdeplug_module *module;
+
+	char discard;
+	Buffer *buffers;
+	Ring packets; // Sent packets, waiting to be received (sender to receiver)
+	Ring free_buffers; // Buffers of the received packets (receiver to sender)
+};
+
+
+static VDECONN *wfbench_open(char *vde_url, char *descr, int interface_version, struct vde_open_args *open_args) {
+	(void)descr; (void)interface_version; (void)open_args;
+	struct wfbench_conn *conn = calloc(1, sizeof(struct wfbench_conn));
+	if (conn == NULL) { return NULL; }
+
+	conn->discard = (vde_url != NULL && strcmp(vde_url, "null") == 0);
+	conn->buffers = malloc(WFBENCH_BUFFERS * sizeof(Buffer));
+	if (conn->buffers == NULL) { goto error; }
+	if (initRing(&conn->packets, WFBENCH_BUFFERS) < 0) { goto error; }
+	if (initRing(&conn->free_buffers, WFBENCH_BUFFERS) < 0) { closeRing(&conn->packets); goto error; }
+
+	for (int i=0; i<WFBENCH_BUFFERS; i++) { ringPush(&conn->free_buffers, &conn->buffers[i]); }
+	ringClearDoorbell(&conn->free_buffers); // The sender polls the free buffers
+
+	return (VDECONN *)conn;
+
+	error:
+		free(conn->buffers);
+		free(conn);
+		return NULL;
+}
+
+static ssize_t wfbench_recv(VDECONN *vde_conn, void *buf, size_t len, int flags) {
+	(void)flags;
+	struct wfbench_conn *conn = (struct wfbench_conn *)vde_conn;
+
+	Buffer *buffer = ringPop(&conn->packets);
+	if (buffer == NULL) { return 1; } // Nothing to receive
+
+	size_t read_len = (buffer->len < len) ? buffer->len : len;
+	memcpy(buf, buffer->data, read_len);
+	ringPush(&conn->free_buffers, buffer);
+
+	// Keeps the data fd readable only while there are packets to receive
+	ringSettleDoorbell(&conn->packets);
+
+	return read_len;
+}
+
+static ssize_t wfbench_send(VDECONN *vde_conn, const void *buf, size_t len, int flags) {
+	(void)flags;
+	struct wfbench_conn *conn = (struct wfbench_conn *)vde_conn;
+	if (conn->discard) { return len; }
+
+	// All the buffers are waiting to be received, the packet is lost as on a real wire
+	Buffer *buffer = ringPop(&conn->free_buffers);
+	if (buffer == NULL) {
+		__atomic_fetch_add(&wfbench_dropped, 1, __ATOMIC_RELAXED);
+		return len;
+	}
+
+	buffer->len = (len < VDE_ETHBUFSIZE) ? len : VDE_ETHBUFSIZE;
+	memcpy(buffer->data, buf, buffer->len);
+	ringPush(&conn->packets, buffer);
+
+	return len;
+}
+
+static int wfbench_datafd(VDECONN *vde_conn) {
+	return ((struct wfbench_conn *)vde_conn)->packets.eventfd;
+}
+
+static int wfbench_ctlfd(VDECONN *vde_conn) {
+	(void)vde_conn;
+	return -1;
+}
+
+static int wfbench_close(VDECONN *vde_conn) {
+	struct wfbench_conn *conn = (struct wfbench_conn *)vde_conn;
+
+	closeRing(&conn->packets);
+	closeRing(&conn->free_buffers);
+	free(conn->buffers);
+	free(conn);
+	return 0;
+}
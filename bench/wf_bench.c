@@ -0,0 +1,265 @@
+/*
+	End-to-end benchmark of the plugin
+	Drives vde_wirefilter_send/vde_wirefilter_recv as fast as the packets are accepted,
+	over the in-process wfbench:// nested VNL, for a matrix of configurations.
+	Like an application, a single thread alternates bursts of sends with the receptions.
+	As with a windowed protocol, at most SEND_WINDOW packets are in flight: the loopback discards
+	packets once its buffers are full, so an unbounded sender would measure its own overrun.
+	Packets that do not come back within the round trip of the configuration (twice its delay, plus a margin)
+	are given up as lost by the wire to reopen the window. A run of a configuration without loss fails
+	if some packets are not delivered.
+	With the loopback each packet crosses the wire twice (L->R, then back R->L),
+	with wfbench://null (-N) only the sending side is measured.
+	The plugin of this build is used directly, even if another one is installed.
+	Results are printed as one JSON object per configuration.
+
+	Usage: wf_bench [-n packets] [-s size] [-t] [-N] [configuration...]
+	  -t  one handler thread per direction (dirthreads)
+	  -N  discard the packets instead of looping them back
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <sched.h>
+#include <libvdeplug.h>
+#include <libvdeplug_mod.h>
+#include "../includes/wf_conn.h"
+
+#define DEFAULT_PACKETS 1000000
+#define DEFAULT_SIZE 100
+#define DRAIN_IDLE_MS 200 // The run is over when nothing is received for this long
+#define SEND_BURST 64 // Packets sent before receiving
+#define SEND_WINDOW 1024 // Packets sent and not received yet, no more than the default receive ring of the plugin
+#define WINDOW_MARGIN_MS 5 // Wait for a packet in flight beyond the round trip before giving them up
+#define MARKOV_NODES 10000
+#define MARKOV_DEGREE 8
+
+static const struct {
+	const char *name;
+	const char *options;
+	int delay_ms; // Delay of each direction
+	char lossy; // Packets may not be delivered
+} configurations[] = {
+	{ "passthrough", "", 0, 0 },
+	{ "delay", "delay=1", 1, 0 },
+	{ "bandwidth", "bandwidth=1000000000", 0, 0 },
+	{ "loss+dup", "loss=10/dup=10", 0, 1 },
+	{ "noise", "noise=100000", 0, 0 },
+	{ "markov", "rc=markov.rc", 0, 0 },
+};
+#define CONFIGURATIONS ( (int)(sizeof(configurations)/sizeof(configurations[0])) )
+
+
+/*
+	Allocation counting
+	The allocator of the process is replaced by wrappers of the glibc one.
+*/
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t allocations;
+
+#define COUNT_ALLOCATION() __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED)
+
+void *malloc(size_t size) { COUNT_ALLOCATION(); return __libc_malloc(size); }
+void *calloc(size_t count, size_t size) { COUNT_ALLOCATION(); return __libc_calloc(count, size); }
+void *realloc(void *ptr, size_t size) { COUNT_ALLOCATION(); return __libc_realloc(ptr, size); }
+void *aligned_alloc(size_t alignment, size_t size) { COUNT_ALLOCATION(); return __libc_memalign(alignment, size); }
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+	COUNT_ALLOCATION();
+	*ptr = __libc_memalign(alignment, size);
+	return (*ptr == NULL) ? ENOMEM : 0;
+}
+void free(void *ptr) { __libc_free(ptr); }
+
+
+static uint64_t monotonic_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec*1000000000 + t.tv_nsec;
+}
+
+/*
+	The plugin of this build is called through its module operations.
+	The nested module is loaded first, so that libvdeplug finds it by name.
+*/
+static uint64_t *nested_dropped;
+
+static struct vdeplug_module *loadModules() {
+	void *nested = dlopen(WF_BENCH_NESTED, RTLD_NOW | RTLD_GLOBAL);
+	if (nested == NULL) { fprintf(stderr, "%s\n", dlerror()); return NULL; }
+	nested_dropped = dlsym(nested, "wfbench_dropped");
+
+	void *plugin = dlopen(WF_BENCH_PLUGIN, RTLD_NOW | RTLD_GLOBAL);
+	if (plugin == NULL) { fprintf(stderr, "%s\n", dlerror()); return NULL; }
+
+	return dlsym(plugin, "vdeplug_ops");
+}
+
+/* Sparse chain with random edges, changing state every ms */
+static int writeMarkovConfig(const char *path) {
+	FILE *rc = fopen(path, "w");
+	if (rc == NULL) { perror(path); return -1; }
+
+	srand(7);
+	fprintf(rc, "markov-numnodes %d\n", MARKOV_NODES);
+	for (int i=0; i<MARKOV_NODES; i++) {
+		for (int j=0; j<MARKOV_DEGREE; j++) { fprintf(rc, "setedge %d,%d,%g\n", i, rand() % MARKOV_NODES, 100.0 / (MARKOV_DEGREE + 1)); }
+	}
+	fprintf(rc, "markov-time 1\n");
+
+	fclose(rc);
+	return 0;
+}
+
+
+/* Receives the packets ready, waiting at most timeout ms for the first one */
+static uint64_t receiveReady(struct vdeplug_module *ops, VDECONN *conn, const int timeout) {
+	static unsigned char buf[VDE_ETHBUFSIZE];
+	struct pollfd poll_fd = { .fd=ops->vde_datafd(conn), .events=POLLIN };
+	uint64_t received = 0;
+
+	// vde_recv blocks, it is called only when a packet is ready
+	while (poll(&poll_fd, 1, received ? 0 : timeout) > 0) {
+		if (ops->vde_recv(conn, buf, sizeof(buf), 0) > 1) { received++; }
+	}
+
+	return received;
+}
+
+/* Returns 1 if some packets of a configuration without loss were not delivered */
+static int runConfiguration(struct vdeplug_module *ops, const int index, const uint64_t packets, const size_t size, const char threads, const char discard) {
+	char url[512];
+	unsigned char packet[VDE_ETHBUFSIZE];
+	uint64_t sent = 0, received = 0, refused = 0;
+	uint64_t given_up = 0; // Packets in flight given up as lost to reopen the window
+	int window_timeout = 2*configurations[index].delay_ms + WINDOW_MARGIN_MS; // Round trip and margin
+
+	memset(packet, 0xa5, size);
+	snprintf(url, sizeof(url), "[%s%s%s]{wfbench://%s}", configurations[index].options,
+			(threads && *configurations[index].options) ? "/" : "", threads ? "dirthreads" : "", discard ? "null" : "");
+
+	uint64_t allocations_start = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+	VDECONN *conn = ops->vde_open_real(url, "wf_bench", LIBVDEPLUG_INTERFACE_VERSION, NULL);
+	if (conn == NULL) { fprintf(stderr, "Cannot open %s\n", configurations[index].name); return -1; }
+	uint64_t allocations_open = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocations_start;
+
+	allocations_start = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+	uint64_t dropped_start = __atomic_load_n(nested_dropped, __ATOMIC_RELAXED);
+	uint64_t start = monotonic_ns();
+	uint64_t last_receive = start;
+	while (sent < packets) {
+		int burst = 0;
+
+		// Window full, waits for the packets in flight
+		if (!discard && sent >= received + given_up + SEND_WINDOW) {
+			uint64_t ready = receiveReady(ops, conn, window_timeout);
+			if (ready > 0) { received += ready; last_receive = monotonic_ns(); }
+			else { given_up = sent - received; }
+			continue;
+		}
+
+		while (sent < packets && burst < SEND_BURST && (discard || sent < received + given_up + SEND_WINDOW)) {
+			if (ops->vde_send(conn, packet, size, 0) < 0) { refused++; break; }
+			sent++;
+			burst++;
+		}
+
+		// Waits for the handler only if the packet could not be sent
+		uint64_t ready = receiveReady(ops, conn, (burst < SEND_BURST && sent < packets && !discard) ? 1 : 0);
+		if (ready > 0) { received += ready; last_receive = monotonic_ns(); }
+		else if (burst < SEND_BURST && sent < packets && discard) { sched_yield(); }
+	}
+	uint64_t send_end = monotonic_ns();
+
+	// Waits for the last packets (delayed ones included)
+	uint64_t ready;
+	while (!discard && (ready = receiveReady(ops, conn, DRAIN_IDLE_MS)) > 0) {
+		received += ready;
+		last_receive = monotonic_ns();
+	}
+	uint64_t allocations_run = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocations_start;
+
+	uint64_t nested = __atomic_load_n(nested_dropped, __ATOMIC_RELAXED) - dropped_start;
+	uint64_t end = (discard || received == 0) ? send_end : last_receive;
+
+	// Packets dropped by the plugin, for any reason and in both directions
+	struct vde_wirefilter_conn *vde_conn = (struct vde_wirefilter_conn *)conn;
+	uint64_t dropped = 0;
+	for (int i=LEFT_TO_RIGHT; i<=RIGHT_TO_LEFT; i++) {
+		for (int j=0; j<DROP_REASONS; j++) { dropped += __atomic_load_n(&vde_conn->stats[i].drops[j], __ATOMIC_RELAXED); }
+	}
+
+	printf("{\"config\":\"%s\",\"options\":\"%s\",\"threads\":\"%s\",\"nested\":\"%s\",\"packets\":%" PRIu64 ",\"size\":%zu,"
+			"\"received\":%" PRIu64 ",\"refused\":%" PRIu64 ",\"given_up\":%" PRIu64 ",\"dropped\":%" PRIu64 ",\"nested_dropped\":%" PRIu64 ",\"seconds\":%.6f,"
+			"\"tx_pps\":%.0f,\"rx_pps\":%.0f,\"ns_per_packet\":%.1f,"
+			"\"allocations_open\":%" PRIu64 ",\"allocations_run\":%" PRIu64 "}\n",
+			configurations[index].name, configurations[index].options, threads ? "dirthreads" : "single", discard ? "null" : "loopback",
+			packets, size, received, refused, given_up, dropped, nested, (end - start) / 1e9,
+			packets * 1e9 / (send_end - start), received * 1e9 / (end - start), (end - start) / (double)packets,
+			allocations_open, allocations_run);
+	fflush(stdout);
+
+	ops->vde_close(conn);
+
+	if (!discard && !configurations[index].lossy && received < packets) {
+		fprintf(stderr, "%s: %" PRIu64 " of %" PRIu64 " packets delivered\n", configurations[index].name, received, packets);
+		return 1;
+	}
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+	uint64_t packets = DEFAULT_PACKETS;
+	size_t size = DEFAULT_SIZE;
+	char threads = 0, discard = 0;
+	char work_dir[] = "/tmp/wf_bench.XXXXXX";
+	int option;
+	int failed = 0;
+
+	while ((option = getopt(argc, argv, "n:s:tNh")) != -1) {
+		switch (option) {
+			case 'n': packets = strtoull(optarg, NULL, 10); break;
+			case 's': size = strtoul(optarg, NULL, 10); break;
+			case 't': threads = 1; break;
+			case 'N': discard = 1; break;
+			default:
+				fprintf(stderr, "Usage: %s [-n packets] [-s size] [-t] [-N] [configuration...]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (packets == 0 || size < 2 || size > VDE_ETHBUFSIZE) { fprintf(stderr, "Invalid packets or size\n"); return 1; }
+
+	struct vdeplug_module *ops = loadModules();
+	if (ops == NULL) { return 1; }
+
+	// Configuration files are looked for in the working directory
+	if (mkdtemp(work_dir) == NULL || chdir(work_dir) < 0) { perror(work_dir); return 1; }
+	if (writeMarkovConfig("markov.rc") < 0) { return 1; }
+
+	for (int i=0; i<CONFIGURATIONS; i++) {
+		char selected = (optind >= argc);
+		for (int j=optind; j<argc; j++) { selected |= (strcmp(argv[j], configurations[i].name) == 0); }
+
+		if (!selected) { continue; }
+
+		int result = runConfiguration(ops, i, packets, size, threads, discard);
+		if (result < 0) { return 1; }
+		failed |= result;
+	}
+
+	unlink("markov.rc");
+	rmdir(work_dir);
+	return failed ? 1 : 0;
+}
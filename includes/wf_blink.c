@@ -0,0 +1,200 @@
+#include "./wf_blink.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "./wf_log.h"
+
+
+static const char *direction_names[2] = { "LR", "RL" };
+
+
+int initBlink(Blink *blink, const char *socket_path, const char *id, const char *sample, const char *interval) {
+	char pid_str[6+1];
+
+	blink->socket_info.sun_family = PF_UNIX;
+	strncpy(blink->socket_info.sun_path, socket_path, sizeof(blink->socket_info.sun_path)-1);
+
+	blink->socket_fd = socket(PF_UNIX, SOCK_DGRAM, 0);
+	handle_error( blink->socket_fd == -1, { return -1; }, "Blink socket error: %s", strerror(errno) );
+
+	// If id is not set, defaults to pid
+	if (id == NULL) {
+		snprintf(pid_str, sizeof(pid_str), "%06d", getpid());
+		id = pid_str;
+	}
+	blink->id = strdup(id);
+	handle_error( blink->id == NULL, { return -1; }, "Blink id malloc error" );
+	blink->id_len = strlen(id);
+
+	// Aggregates take precedence over samples
+	blink->mode = BLINK_MODE_PACKET;
+	blink->sample = 1;
+	if (interval) {
+		blink->mode = BLINK_MODE_AGGREGATE;
+		blink->interval = MS_TO_NS(strtoull(interval, NULL, 10));
+		handle_error( blink->interval == 0, { return -1; }, "Invalid blink interval: %s", interval );
+	}
+	else if (sample) {
+		blink->mode = BLINK_MODE_SAMPLE;
+		blink->sample = strtoul(sample, NULL, 10);
+		handle_error( blink->sample == 0, { return -1; }, "Invalid blink sampling rate: %s", sample );
+	}
+
+	for (int i=0; i<2; i++) {
+		blink->dir[i].skip = blink->sample;
+		if (blink->mode == BLINK_MODE_AGGREGATE) { continue; }
+		blink->dir[i].lengths = malloc(BLINK_RING_SIZE * sizeof(uint32_t));
+		handle_error( blink->dir[i].lengths == NULL, { return -1; }, "Blink ring malloc error" );
+	}
+
+	// Each message of the batch keeps the id, only the content is written when flushing
+	blink->buffer_size = blink->id_len + 1 + BLINK_MESSAGE_CONTENT_SIZE;
+	blink->buffers = malloc(BLINK_BATCH * blink->buffer_size);
+	blink->messages = calloc(BLINK_BATCH, sizeof(struct mmsghdr));
+	blink->iovecs = calloc(BLINK_BATCH, sizeof(struct iovec));
+	handle_error( blink->buffers == NULL || blink->messages == NULL || blink->iovecs == NULL, { return -1; }, "Blink batch malloc error" );
+
+	for (int i=0; i<BLINK_BATCH; i++) {
+		char *buffer = blink->buffers + i*blink->buffer_size;
+		memcpy(buffer, blink->id, blink->id_len);
+		buffer[blink->id_len] = ' ';
+
+		blink->iovecs[i].iov_base = buffer;
+		blink->messages[i].msg_hdr.msg_iov = &blink->iovecs[i];
+		blink->messages[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	blink->timer = (LoopTimer){ 0 };
+
+	return 0;
+}
+
+void closeBlink(Blink *blink) {
+	// Waiting events are sent as long as the listener accepts them
+	blinkFlush(blink);
+
+	close(blink->socket_fd);
+	remove(blink->socket_info.sun_path);
+
+	for (int i=0; i<2; i++) { free(blink->dir[i].lengths); }
+	free(blink->buffers);
+	free(blink->messages);
+	free(blink->iovecs);
+	free(blink->id);
+}
+
+const char *blinkModeName(const Blink *blink) {
+	switch (blink->mode) {
+		case BLINK_MODE_SAMPLE: return "sample";
+		case BLINK_MODE_AGGREGATE: return "aggregate";
+		default: return "packet";
+	}
+}
+
+
+/* Arms the timer at the next flush */
+void blinkSetTimer(Blink *blink, const char restart) {
+	uint64_t now = now_ns();
+	uint64_t period = (blink->mode == BLINK_MODE_AGGREGATE) ? blink->interval : BLINK_FLUSH_NS;
+
+	if (restart) { blink->next_flush = now; }
+	blink->next_flush += period;
+	if (blink->next_flush <= now) { blink->next_flush = now + period; }
+
+	timerSet(&blink->timer, blink->next_flush);
+}
+
+
+/* Writes the content of the i-th message of the batch */
+static void blinkFormat(Blink *blink, const int i, const char *format, ...) {
+	char *content = (char *)blink->iovecs[i].iov_base + blink->id_len + 1;
+	va_list args;
+
+	va_start(args, format);
+	int len = vsnprintf(content, BLINK_MESSAGE_CONTENT_SIZE, format, args);
+	va_end(args);
+
+	if (len >= BLINK_MESSAGE_CONTENT_SIZE) { len = BLINK_MESSAGE_CONTENT_SIZE-1; }
+	blink->iovecs[i].iov_len = blink->id_len + 1 + len;
+}
+
+/**
+ * Sends the first messages of the batch without blocking.
+ * Returns the number of messages sent or discarded, the others have to be sent again when the listener is ready.
+*/
+static unsigned int blinkSend(Blink *blink, const unsigned int count) {
+	unsigned int sent = 0;
+
+	// The socket is connected so that its writability reflects the queue of the listener
+	if (!blink->connected && count > 0) {
+		blink->connected = (connect(blink->socket_fd, (struct sockaddr *)&blink->socket_info, sizeof(blink->socket_info)) == 0);
+	}
+	if (!blink->connected) {
+		blink->unsent += count; // No listener, the messages are discarded
+		return count;
+	}
+
+	while (sent < count) {
+		int ret = sendmmsg(blink->socket_fd, &blink->messages[sent], count - sent, MSG_DONTWAIT);
+		if (ret > 0) { sent += ret; continue; }
+		if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+
+		// The listener is gone, a new one is looked for at the next flush
+		blink->connected = 0;
+		blink->unsent += count - sent;
+		return count;
+	}
+
+	return sent;
+}
+
+/**
+ * Sends the recorded events (consumer side).
+ * Returns 1 if the listener is not keeping up and some events are still waiting.
+*/
+int blinkFlush(Blink *blink) {
+	unsigned int count = 0, done;
+
+	if (blink->mode == BLINK_MODE_AGGREGATE) {
+		uint64_t packets[2], bytes[2];
+		for (int i=0; i<2; i++) {
+			struct blink_direction_t *dir = &blink->dir[i];
+			packets[i] = __atomic_load_n(&dir->packets, __ATOMIC_RELAXED);
+			bytes[i] = __atomic_load_n(&dir->bytes, __ATOMIC_RELAXED);
+			blinkFormat(blink, count++, "%s %" PRIu64 " %" PRIu64 "\n", direction_names[i], packets[i] - dir->reported_packets, bytes[i] - dir->reported_bytes);
+		}
+
+		// Unsent aggregates are merged into the next ones
+		done = blinkSend(blink, count);
+		for (unsigned int i=0; i<done; i++) {
+			blink->dir[i].reported_packets = packets[i];
+			blink->dir[i].reported_bytes = bytes[i];
+		}
+		return done < count;
+	}
+
+	for (int i=0; i<2; i++) {
+		struct blink_direction_t *dir = &blink->dir[i];
+		unsigned int head = dir->head;
+		unsigned int tail = __atomic_load_n(&dir->tail, __ATOMIC_ACQUIRE);
+
+		while (head != tail) {
+			count = 0;
+			for (unsigned int j=head; j != tail && count < BLINK_BATCH; j++) {
+				blinkFormat(blink, count++, "%s %" PRIu32 "\n", direction_names[i], dir->lengths[j & (BLINK_RING_SIZE-1)]);
+			}
+
+			// Events are released only once sent
+			done = blinkSend(blink, count);
+			head += done;
+			__atomic_store_n(&dir->head, head, __ATOMIC_RELEASE);
+			if (done < count) { return 1; }
+		}
+	}
+
+	return 0;
+}
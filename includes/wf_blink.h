@@ -0,0 +1,94 @@
+#ifndef INCLUDE_BLINK
+#define INCLUDE_BLINK
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "./wf_time.h"
+#include "./wf_loop.h"
+
+#define BLINK_MODE_PACKET		0 // One message for each forwarded packet
+#define BLINK_MODE_SAMPLE		1 // One message every N forwarded packets
+#define BLINK_MODE_AGGREGATE	2 // Packets and bytes of each direction every N ms
+
+#define BLINK_RING_SIZE 8192 // Events of a direction waiting to be sent (power of 2)
+#define BLINK_BATCH 64 // Messages sent with a single sendmmsg
+#define BLINK_FLUSH_NS MS_TO_NS(5) // Period of the flush of the events
+#define BLINK_MESSAGE_CONTENT_SIZE 48 // Size of blink messages without the id
+
+
+/**
+ * Per-direction events, written only by the thread forwarding the direction.
+ * The events are read (and sent) by the control thread.
+*/
+struct blink_direction_t {
+	uint32_t *lengths; // Ring of the lengths of the forwarded packets
+	unsigned int tail; // Written by the producer
+	unsigned int skip; // Packets to forward before the next sample
+	uint64_t packets; // Forwarded packets
+	uint64_t bytes; // Forwarded bytes
+	uint64_t lost; // Events discarded because the ring was full
+
+	char pad[64];
+	unsigned int head; // Written by the consumer
+	uint64_t reported_packets;
+	uint64_t reported_bytes;
+} __attribute__((aligned(64)));
+
+struct blink_t {
+	int socket_fd;
+	struct sockaddr_un socket_info;
+	char *id;
+	int id_len;
+
+	char mode;
+	unsigned int sample; // Sampling rate (BLINK_MODE_SAMPLE)
+	uint64_t interval; // Aggregation interval in ns (BLINK_MODE_AGGREGATE)
+	LoopTimer timer;
+	uint64_t next_flush; // Deadline of the next flush
+
+	// Batch of messages (each one starts with the id)
+	char *buffers;
+	size_t buffer_size;
+	struct mmsghdr *messages;
+	struct iovec *iovecs;
+	char connected;
+	uint64_t unsent; // Messages discarded as no listener was reachable
+
+	struct blink_direction_t dir[2];
+};
+typedef struct blink_t Blink;
+
+
+int initBlink(Blink *blink, const char *socket_path, const char *id, const char *sample, const char *interval);
+void closeBlink(Blink *blink);
+void blinkSetTimer(Blink *blink, const char restart);
+int blinkFlush(Blink *blink);
+const char *blinkModeName(const Blink *blink);
+
+
+/* Records a forwarded packet (producer side, never blocks) */
+static inline void blinkPacket(Blink *blink, const int direction, const size_t len) {
+	struct blink_direction_t *dir = &blink->dir[direction];
+
+	// Single writer, the stores only need to be atomic for the reader
+	__atomic_store_n(&dir->packets, dir->packets + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&dir->bytes, dir->bytes + len, __ATOMIC_RELAXED);
+
+	if (blink->mode == BLINK_MODE_AGGREGATE) { return; }
+	if (blink->mode == BLINK_MODE_SAMPLE) {
+		if (--dir->skip > 0) { return; }
+		dir->skip = blink->sample;
+	}
+
+	unsigned int tail = dir->tail;
+	if (tail - __atomic_load_n(&dir->head, __ATOMIC_ACQUIRE) >= BLINK_RING_SIZE) {
+		__atomic_store_n(&dir->lost, dir->lost + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	dir->lengths[tail & (BLINK_RING_SIZE-1)] = len;
+	__atomic_store_n(&dir->tail, tail+1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -4,18 +4,37 @@
 #include "./wf_log.h"
 
 Packet *packetCopy(const Packet *to_copy) {
-	Packet *packet_copy = malloc(sizeof(Packet));
-	handle_error( packet_copy == NULL, { return NULL; }, "Error while copying packet (malloc)" );
+	Packet *packet_copy = poolAlloc(to_copy->pool);
+	handle_error( packet_copy == NULL, { return NULL; }, "Error while copying packet (pool exhausted)" );
 	
-	memcpy(packet_copy, to_copy, sizeof(Packet));
-	packet_copy->buf = malloc(to_copy->len);
-	handle_error( packet_copy->buf == NULL, { return NULL; }, "Error while copying packet payload (malloc)" );
 	memcpy(packet_copy->buf, to_copy->buf, to_copy->len);
+	packet_copy->len = to_copy->len;
+	packet_copy->flags = to_copy->flags;
+	packet_copy->direction = to_copy->direction;
 
 	return packet_copy;
 }
 
+/* Creates a packet that shares the payload of another one (the payload must not be modified) */
+Packet *packetClone(Packet *to_clone) {
+	Packet *packet_clone = poolClone(to_clone);
+	handle_error( packet_clone == NULL, { return NULL; }, "Error while cloning packet (pool exhausted)" );
+
+	return packet_clone;
+}
+
+/**
+ * Returns a packet whose payload can be modified (copy-on-write of shared payloads)
+ * The given packet is released if a copy is made, NULL is returned on error.
+*/
+Packet *packetMakeWritable(Packet *packet) {
+	if (__atomic_load_n(&packet->payload->refcount, __ATOMIC_ACQUIRE) == 1) { return packet; }
+
+	Packet *packet_copy = packetCopy(packet);
+	packetDestroy(packet);
+	return packet_copy;
+}
+
 void packetDestroy(Packet *to_destroy) {
-	free(to_destroy->buf);
-	free(to_destroy);
+	poolRelease(to_destroy);
 }
\ No newline at end of file
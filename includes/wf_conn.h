@@ -8,6 +8,11 @@
 #include "./wf_markov.h"
 #include "./wf_queue.h"
 #include "./wf_management.h"
+#include "./wf_pool.h"
+#include "./wf_ring.h"
+#include "./wf_loop.h"
+#include "./wf_random.h"
+#include "./wf_blink.h"
 
 #define LEFT_TO_RIGHT 0
 #define RIGHT_TO_LEFT 1
@@ -19,9 +24,28 @@
 #define NO_FIFO 0
 #define FIFO	1
 
-#define BLINK_MESSAGE_CONTENT_SIZE 20 // Size of blink messages without the id
+#define BACKPRESSURE_EAGAIN 0 // Packets sent when the send ring is full are refused with EAGAIN
+#define BACKPRESSURE_DROP	1 // Packets sent when the send ring is full are discarded
 
-#define MNGM_MAX_CONN 3
+#define SPEED_MODE_BLOCK	0 // The sender sleeps while the (left to right) interface is busy
+#define SPEED_MODE_NONBLOCK	1 // The sender never sleeps, the handler takes packets from the send ring only when the interface is free
+
+#define DUP_DEFAULT_MAX 16 // Default maximum number of duplicates of a packet
+
+// Reasons for dropping a packet
+#define DROP_MTU			0
+#define DROP_LOSS			1
+#define DROP_BURSTYLOSS		2
+#define DROP_CHANBUFSIZE	3
+#define DROP_POOL			4 // Packet pool exhausted
+#define DROP_RING			5 // Handoff ring full
+#define DROP_REASONS		6
+
+#define HANDLER_LR		0x1 // Left to right packets
+#define HANDLER_RL		0x2 // Right to left packets
+#define HANDLER_CONTROL	0x4 // Markov chain and management
+#define HANDLER_ALL		(HANDLER_LR | HANDLER_RL | HANDLER_CONTROL)
+#define HANDLER_MAX_THREADS 3
 
 
 struct packet_t {
@@ -29,10 +53,45 @@ struct packet_t {
 	size_t len;
 	int flags;
 	int direction;
+
+	Packet *payload; // Packet that owns the payload buffer (itself if not shared)
+	unsigned int refcount; // Number of packets referring to the payload (valid for the payload owner)
+	PacketPool *pool; // Pool that owns the buffer
+	Packet *next; // Pool free list
+	unsigned char data[]; // Inline payload of VDE_ETHBUFSIZE bytes
 };
 typedef struct packet_t Packet;
 
 
+struct vde_wirefilter_conn;
+
+/**
+ * Dataplane counters of a direction.
+ * They are updated by the thread handling the direction while holding the wire lock for reading,
+ * except for pool and ring drops that may happen outside the lock and are updated atomically.
+*/
+typedef struct {
+	uint64_t packets_in;
+	uint64_t bytes_in;
+	uint64_t packets_out;
+	uint64_t bytes_out;
+	uint64_t duplicates;
+	uint64_t flipped_bits;
+	uint64_t drops[DROP_REASONS];
+} __attribute__((aligned(64))) WireStats;
+
+#define STATS_DROP(vde_conn, direction, reason) ((vde_conn)->stats[(direction)].drops[(reason)]++)
+#define STATS_DROP_ATOMIC(vde_conn, direction, reason) __atomic_fetch_add(&(vde_conn)->stats[(direction)].drops[(reason)], 1, __ATOMIC_RELAXED)
+
+
+typedef struct {
+	struct vde_wirefilter_conn *vde_conn;
+	pthread_t thread;
+	int roles; // Which part of the work is done by the thread (HANDLER_*)
+	EventLoop loop;
+} HandlerThread;
+
+
 // Connection structure of the module
 struct vde_wirefilter_conn {
 	void *handle;
@@ -40,59 +99,78 @@ struct vde_wirefilter_conn {
 
 	VDECONN *conn;
 	
-	pthread_t packet_handler_thread;
-	int *send_pipefd;
-	int *receive_pipefd;
-	pthread_mutex_t receive_lock; // Mutex to prevent multiple writes on the receive pipe
+	HandlerThread handlers[HANDLER_MAX_THREADS];
+	int handlers_count;
+	pthread_rwlock_t wire_lock; // Taken for reading while handling packets, for writing while changing the wire
+	Ring send_ring; // Left to right packets waiting for the handler thread
+	char backpressure;
+	Ring receive_ring; // Right to left packets ready to be received
+
+	PacketPool pool;
+	unsigned int dup_max; // Maximum number of duplicates of a packet
 
 	struct {
-		QueueNode **queue; // Priority queue implemented as heap
-		unsigned int size;
-		unsigned int max_size;
-		unsigned int byte_size[2];
-		int timerfd; // Timer for packets delay
-		
-		// To preserve fifoness
+		DelayQueue dir[2]; // One delay queue for each direction
 		char fifoness;
-		uint64_t max_forward_time;
-		unsigned int counter;
+		char engine; // Engine used when fifoness is not preserved
+		uint64_t tick_ns; // Timing wheel granularity
+		uint64_t timer_slack; // Maximum delay (ns) of a release to share the wake up of an earlier one
 	} queue;
 
 	struct {
-		MarkovNode **nodes;
+		MarkovNode *nodes;
 		int current_node;
 		int nodes_count;
-		double *adjacency;
+
+		// Nodes with pending updates
+		char deferred;
+		int *modified;
+		int modified_count;
+		int modified_size;
 
 		uint64_t change_frequency; // Time (in ns) after which the state will change
-		int timerfd;
+		uint64_t next_change; // Deadline of the next state change
+		LoopTimer timer;
 	} markov;
 
 	struct {
-		int socket_fd;
-		struct sockaddr_un socket_info;
-		char *message;
-		int id_len;
-	} blink;
+		uint64_t seed;
+		Random streams[MARKOV_NODE_VALUES][2]; // One stream for each impairment and direction
+		Random markov;
+	} random;
 
-	char bursty_loss_status[2];
+	Blink blink;
 
-	// Next timestamp (ns) at when a packet can be sent
-	uint64_t bandwidth_next[2];
-	uint64_t speed_next[2];
-	int speed_timer; // Timer to restart receiving packets during speed handling
+	// Shaping state of each direction (on separate cache lines as directions may be handled by different threads)
+	struct {
+		char bursty_loss_status;
+
+		// Next timestamp (ns) at when a packet can be sent
+		uint64_t bandwidth_next;
+		uint64_t speed_next;
+	} __attribute__((aligned(64))) shaping[2];
+	LoopTimer speed_timer[2]; // Timers to restart taking the packets of a direction during speed handling
+	char speed_mode;
+	unsigned int speed_queue; // Packets that can wait for the interface in the send ring (non-blocking speed handling)
+
+	WireStats stats[2];
+	uint64_t stats_since; // Time of the last stats reset
 
 	struct {
 		int socket_fd;
 		unsigned int mode;
 		int connections_count;
-		int connections[MNGM_MAX_CONN];
-		int debug_level[MNGM_MAX_CONN];
+		int connections_size;
+		struct mngm_client_t **connections;
 		char *socket_name;
 	} management;
 };
 
+#define RANDOM_STREAM(vde_conn, tag, direction) (&(vde_conn)->random.streams[(tag)][(direction)])
+
 Packet *packetCopy(const Packet *to_copy);
+Packet *packetClone(Packet *to_clone);
+Packet *packetMakeWritable(Packet *packet);
 void packetDestroy(Packet *to_destroy);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,39 @@
+#include "./wf_histogram.h"
+#include <string.h>
+#include <math.h>
+
+
+void histogramReset(Histogram *histogram) {
+	memset(histogram, 0, sizeof(Histogram));
+}
+
+/* Highest value counted in a bucket */
+static uint64_t bucketHighest(const unsigned int index) {
+	if (index < 2*HISTOGRAM_SUB_BUCKETS) { return index; }
+
+	unsigned int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+	uint64_t mantissa = (index & (HISTOGRAM_SUB_BUCKETS-1)) + HISTOGRAM_SUB_BUCKETS;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+/**
+ * Returns the value below which (at least) the given percentage of the recorded values falls.
+ * The value is rounded up to the end of its bucket, but never beyond the maximum.
+*/
+uint64_t histogramPercentile(const Histogram *histogram, const double percentile) {
+	if (histogram->total == 0) { return 0; }
+
+	uint64_t rank = (uint64_t)ceil(histogram->total * percentile / 100);
+	if (rank < 1) { rank = 1; }
+
+	uint64_t count = 0;
+	for (unsigned int i=0; i<HISTOGRAM_BUCKETS; i++) {
+		count += histogram->counts[i];
+		if (count >= rank) {
+			uint64_t value = bucketHighest(i);
+			return (value < histogram->max) ? value : histogram->max;
+		}
+	}
+
+	return histogram->max;
+}
@@ -0,0 +1,42 @@
+#ifndef INCLUDE_HISTOGRAM
+#define INCLUDE_HISTOGRAM
+
+#include <stdint.h>
+
+/*
+	Log-linear histogram (HDR style) of non-negative integer values.
+	Values below 2*HISTOGRAM_SUB_BUCKETS are counted exactly, each larger power of 2
+	is split in HISTOGRAM_SUB_BUCKETS buckets, so the relative error is below 1/HISTOGRAM_SUB_BUCKETS.
+*/
+#define HISTOGRAM_SUB_BITS		5
+#define HISTOGRAM_SUB_BUCKETS	(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS		((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+
+struct histogram_t {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total; // Recorded values
+	uint64_t max;
+};
+typedef struct histogram_t Histogram;
+
+
+void histogramReset(Histogram *histogram);
+uint64_t histogramPercentile(const Histogram *histogram, const double percentile);
+
+
+static inline unsigned int histogramIndex(const uint64_t value) {
+	if (value < 2*HISTOGRAM_SUB_BUCKETS) { return value; }
+
+	// The first HISTOGRAM_SUB_BITS+1 significant bits select the bucket
+	unsigned int shift = (63 - __builtin_clzll(value)) - HISTOGRAM_SUB_BITS;
+	return (shift << HISTOGRAM_SUB_BITS) + (value >> shift);
+}
+
+static inline void histogramRecord(Histogram *histogram, const uint64_t value) {
+	histogram->counts[histogramIndex(value)]++;
+	histogram->total++;
+	if (value > histogram->max) { histogram->max = value; }
+}
+
+#endif
@@ -0,0 +1,175 @@
+#include "./wf_loop.h"
+#include <unistd.h>
+#include <pthread.h>
+#include "./wf_time.h"
+#include "./wf_log.h"
+
+#define TIMER_EXPIRED UINT64_MAX // The timerfd expired, it has to be re-armed or disarmed to clear the expiration
+
+static void onLoopTimer(EventLoop *loop, EventHandler *handler, const uint32_t events);
+
+
+int initLoop(EventLoop *loop, struct vde_wirefilter_conn *vde_conn) {
+	loop->vde_conn = vde_conn;
+	loop->timers_count = 0;
+	loop->timer_deadline = 0;
+	loop->dispatching = 0;
+	loop->timer_syscalls = 0;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	handle_error( loop->epoll_fd < 0, { return -1; }, "Event loop init error: %s", strerror(errno) );
+
+	loop->timerfd = newTimer();
+	handle_error( loop->timerfd < 0, { close(loop->epoll_fd); return -1; }, "Event loop timer fd init error: %s", strerror(errno) );
+	loop->timer_handler = (EventHandler){ .fd=loop->timerfd, .callback=onLoopTimer };
+	handle_error( loopAdd(loop, &loop->timer_handler, EPOLLIN) < 0, { closeLoop(loop); return -1; }, NULL );
+
+	return 0;
+}
+
+void closeLoop(EventLoop *loop) {
+	close(loop->timerfd);
+	close(loop->epoll_fd);
+}
+
+
+int loopAdd(EventLoop *loop, EventHandler *handler, const uint32_t events) {
+	struct epoll_event event = { .events=events, .data.ptr=handler };
+	handle_error( epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, handler->fd, &event) < 0, { return -1; }, "Event loop add error: %s", strerror(errno) );
+
+	return 0;
+}
+
+int loopModify(EventLoop *loop, EventHandler *handler, const uint32_t events) {
+	struct epoll_event event = { .events=events, .data.ptr=handler };
+	handle_error( epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, handler->fd, &event) < 0, { return -1; }, "Event loop modify error: %s", strerror(errno) );
+
+	return 0;
+}
+
+void loopRemove(EventLoop *loop, EventHandler *handler) {
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+
+/*
+	Deadline scheduler
+*/
+
+static void heapPlace(EventLoop *loop, LoopTimer *timer, const unsigned int index) {
+	loop->timers[index] = timer;
+	timer->index = index;
+}
+
+/* Moves a timer to its position in the heap */
+static void heapFix(EventLoop *loop, unsigned int index) {
+	LoopTimer *timer = loop->timers[index];
+
+	while (index > 1 && loop->timers[index>>1]->deadline > timer->deadline) {
+		heapPlace(loop, loop->timers[index>>1], index);
+		index >>= 1;
+	}
+	while ((index<<1) <= loop->timers_count) {
+		unsigned int child = index<<1;
+		if (child < loop->timers_count && loop->timers[child+1]->deadline < loop->timers[child]->deadline) { child++; }
+		if (loop->timers[child]->deadline >= timer->deadline) { break; }
+
+		heapPlace(loop, loop->timers[child], index);
+		index = child;
+	}
+	heapPlace(loop, timer, index);
+}
+
+/* Arms the timerfd at the earliest deadline, if it changed */
+static void armLoopTimer(EventLoop *loop) {
+	uint64_t deadline = 0;
+	if (loop->timers_count > 0) { deadline = (loop->timers[1]->deadline > 0) ? loop->timers[1]->deadline : 1; }
+	if (deadline == loop->timer_deadline) { return; }
+
+	if (deadline > 0) { setTimerAt(loop->timerfd, deadline); }
+	else { disarmTimer(loop->timerfd); }
+	loop->timer_deadline = deadline;
+	__atomic_fetch_add(&loop->timer_syscalls, 1, __ATOMIC_RELAXED);
+}
+
+/* Binds a timer to the loop that serves it */
+void loopAttachTimer(EventLoop *loop, LoopTimer *timer, TimerCallback callback, void *arg) {
+	timer->loop = loop;
+	timer->callback = callback;
+	timer->arg = arg;
+	timer->index = 0;
+}
+
+/* Arms (or moves) a timer at an absolute deadline */
+void timerSet(LoopTimer *timer, const uint64_t deadline) {
+	EventLoop *loop = timer->loop;
+
+	timer->deadline = deadline;
+	if (loop == NULL) { return; }
+
+	if (timer->index == 0) {
+		handle_error( loop->timers_count >= LOOP_MAX_TIMERS, { return; }, "Too many loop timers" );
+		heapPlace(loop, timer, ++loop->timers_count);
+	}
+	heapFix(loop, timer->index);
+
+	if (!loop->dispatching) { armLoopTimer(loop); }
+}
+
+void timerCancel(LoopTimer *timer) {
+	EventLoop *loop = timer->loop;
+	if (loop == NULL || timer->index == 0) { return; }
+
+	// The last timer takes the place of the removed one
+	LoopTimer *last = loop->timers[loop->timers_count--];
+	if (last != timer) {
+		heapPlace(loop, last, timer->index);
+		heapFix(loop, last->index);
+	}
+	timer->index = 0;
+
+	if (!loop->dispatching) { armLoopTimer(loop); }
+}
+
+/* Serves the expired timers, the timerfd is armed again only once */
+static void onLoopTimer(EventLoop *loop, EventHandler *handler, const uint32_t events) {
+	(void)handler; (void)events;
+	uint64_t now = now_ns();
+
+	loop->timer_deadline = TIMER_EXPIRED;
+	loop->dispatching = 1;
+	while (loop->timers_count > 0 && loop->timers[1]->deadline <= now) {
+		LoopTimer *timer = loop->timers[1];
+		timerCancel(timer);
+		timer->callback(loop, timer); // It may arm the timer again
+	}
+	loop->dispatching = 0;
+
+	armLoopTimer(loop);
+}
+
+
+/**
+ * Waits for events and dispatches them to the handlers, never returns.
+ * The thread can only be canceled while waiting, so callbacks are never interrupted.
+*/
+void loopRun(EventLoop *loop) {
+	struct epoll_event events[LOOP_MAX_EVENTS];
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	while (1) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int ready = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS, -1);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (ready < 0) {
+			handle_error( errno != EINTR, {}, "Event loop wait error: %s", strerror(errno) );
+			continue;
+		}
+
+		for (int i=0; i<ready; i++) {
+			EventHandler *handler = events[i].data.ptr;
+			handler->callback(loop, handler, events[i].events);
+		}
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef INCLUDE_LOOP
+#define INCLUDE_LOOP
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define LOOP_MAX_EVENTS 16 // Events retrieved at each wake up
+#define LOOP_MAX_TIMERS 8 // Timers that can be armed at the same time on a loop
+
+struct vde_wirefilter_conn;
+struct event_loop_t;
+struct event_handler_t;
+struct loop_timer_t;
+
+typedef void (*EventCallback)(struct event_loop_t *loop, struct event_handler_t *handler, const uint32_t events);
+typedef void (*TimerCallback)(struct event_loop_t *loop, struct loop_timer_t *timer);
+
+
+/* File descriptor watched by an event loop, the handler must stay valid while registered */
+struct event_handler_t {
+	int fd;
+	EventCallback callback;
+	void *arg;
+};
+typedef struct event_handler_t EventHandler;
+
+/**
+ * Deadline served by an event loop, its callback is called by the loop thread once the deadline has passed.
+ * Timers are one-shot and can only be armed by the thread of their loop, a zeroed timer is detached and disarmed.
+*/
+struct loop_timer_t {
+	uint64_t deadline; // Last deadline set (ns, as returned by now_ns())
+	unsigned int index; // Position in the heap of the loop, 0 if not armed
+	struct event_loop_t *loop; // Loop serving the timer, deadlines set before attaching are ignored
+	TimerCallback callback;
+	void *arg;
+};
+typedef struct loop_timer_t LoopTimer;
+
+struct event_loop_t {
+	int epoll_fd;
+	struct vde_wirefilter_conn *vde_conn;
+
+	// Deadline scheduler: a single timerfd armed at the earliest deadline of the armed timers
+	int timerfd;
+	EventHandler timer_handler;
+	uint64_t timer_deadline; // Deadline the timerfd is armed at (0 if disarmed)
+	LoopTimer *timers[LOOP_MAX_TIMERS+1]; // Min-heap by deadline of the armed timers (from index 1)
+	unsigned int timers_count;
+	char dispatching; // The timerfd is re-armed once all the expired timers have been served
+	uint64_t timer_syscalls; // Arming and disarming of the timerfd
+};
+typedef struct event_loop_t EventLoop;
+
+
+int initLoop(EventLoop *loop, struct vde_wirefilter_conn *vde_conn);
+void closeLoop(EventLoop *loop);
+
+int loopAdd(EventLoop *loop, EventHandler *handler, const uint32_t events);
+int loopModify(EventLoop *loop, EventHandler *handler, const uint32_t events);
+void loopRemove(EventLoop *loop, EventHandler *handler);
+
+void loopAttachTimer(EventLoop *loop, LoopTimer *timer, TimerCallback callback, void *arg);
+void timerSet(LoopTimer *timer, const uint64_t deadline);
+void timerCancel(LoopTimer *timer);
+
+static inline char timerArmed(const LoopTimer *timer) {
+	return timer->index != 0;
+}
+
+void loopRun(EventLoop *loop);
+
+#endif
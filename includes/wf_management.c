@@ -6,8 +6,10 @@
 #include <errno.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include "./wf_markov.h"
 #include "./wf_time.h"
 #include "./wf_log.h"
@@ -22,6 +24,8 @@ static char prompt[]="\nVDEwf$ ";
 
 #define WITHFILE 0x80
 
+#define RC_LINES_PER_LOCK 1024 // Lines executed before releasing the wire lock during a load
+
 
 int initManagement(struct vde_wirefilter_conn *vde_conn, char *socket_path, char *mode_str) {
 	vde_conn->management.mode = 0700;
@@ -30,6 +34,8 @@ int initManagement(struct vde_wirefilter_conn *vde_conn, char *socket_path, char
 	}
 
 	vde_conn->management.connections_count = 0;
+	vde_conn->management.connections_size = 0;
+	vde_conn->management.connections = NULL;
 	vde_conn->management.socket_name = socket_path;
 	handle_error( createManagementSocket(vde_conn, socket_path) < 0, { return -1; }, "Error while creating management socket" );
 
@@ -37,6 +43,11 @@ int initManagement(struct vde_wirefilter_conn *vde_conn, char *socket_path, char
 }
 
 void closeManagement(struct vde_wirefilter_conn *vde_conn) {
+	while (vde_conn->management.connections_count > 0) {
+		closeManagementConnection(vde_conn, vde_conn->management.connections[0]);
+	}
+	free(vde_conn->management.connections);
+
 	close(vde_conn->management.socket_fd);
 	remove(vde_conn->management.socket_name);
 }
@@ -63,44 +74,51 @@ int createManagementSocket(struct vde_wirefilter_conn *vde_conn, char *socket_na
 }
 
 
-int acceptManagementConnection(struct vde_wirefilter_conn *vde_conn) {
+MngmClient *acceptManagementConnection(struct vde_wirefilter_conn *vde_conn) {
 	int new_connection;
 	char buf[MNGM_CMD_MAX_LEN];
 
-	new_connection = accept(vde_conn->management.socket_fd, NULL, NULL);
-	handle_error( new_connection < 0, { return -1; }, "Error while accepting new management connection" );
+	new_connection = accept4(vde_conn->management.socket_fd, NULL, NULL, SOCK_CLOEXEC);
+	handle_error( new_connection < 0, { return NULL; }, "Error while accepting new management connection" );
 	
-	if (vde_conn->management.connections_count < MNGM_MAX_CONN) { // Connection can be accepted
-		snprintf(buf, MNGM_CMD_MAX_LEN, header, PACKAGE_VERSION);
-		handle_error( write(new_connection, buf, strlen(buf)) < 0, { return -1; }, "Error while sending message to management socket" );
-		handle_error( write(new_connection, prompt, strlen(prompt)) < 0, { return -1; }, "Error while sending message to management socket" );
-
-		vde_conn->management.connections[vde_conn->management.connections_count] = new_connection;
-		vde_conn->management.debug_level[vde_conn->management.connections_count] = 0;
-        vde_conn->management.connections_count++;
-		
-		return new_connection;
-	} else { // Too many active connections
-		close(new_connection);
-		return -1;
+	snprintf(buf, MNGM_CMD_MAX_LEN, header, PACKAGE_VERSION);
+	handle_error( write(new_connection, buf, strlen(buf)) < 0, { close(new_connection); return NULL; }, "Error while sending message to management socket" );
+	handle_error( write(new_connection, prompt, strlen(prompt)) < 0, { close(new_connection); return NULL; }, "Error while sending message to management socket" );
+
+	// Client list resize
+	if (vde_conn->management.connections_count >= vde_conn->management.connections_size) {
+		int new_size = vde_conn->management.connections_size + MNGM_CLIENTS_CHUNK;
+		MngmClient **new_connections = realloc(vde_conn->management.connections, new_size * sizeof(MngmClient *));
+		handle_error( new_connections == NULL, { close(new_connection); return NULL; }, "Management clients realloc error" );
+
+		vde_conn->management.connections = new_connections;
+		vde_conn->management.connections_size = new_size;
 	}
-}
 
+	MngmClient *client = calloc(1, sizeof(MngmClient));
+	handle_error( client == NULL, { close(new_connection); return NULL; }, "Management client malloc error" );
+	client->fd = new_connection;
+	client->debug_level = 0;
 
-int closeManagementConnection(struct vde_wirefilter_conn *vde_conn, int socket_fd) {
-	int index = 0;
-	
-	// Determines fd index
-	while (index < vde_conn->management.connections_count && vde_conn->management.connections[index] != socket_fd) { index++; };
-	if (vde_conn->management.connections[index] != socket_fd) { return -1; }
+	vde_conn->management.connections[vde_conn->management.connections_count] = client;
+	vde_conn->management.connections_count++;
+		
+	return client;
+}
 
-	close(vde_conn->management.connections[index]);
 
-	// Shifts connections list
-	memmove(&vde_conn->management.connections[index], &vde_conn->management.connections[index+1], sizeof(int) * (vde_conn->management.connections_count-index-1));
-	memmove(&vde_conn->management.debug_level[index], &vde_conn->management.debug_level[index+1], sizeof(int) * (vde_conn->management.connections_count-index-1));
+void closeManagementConnection(struct vde_wirefilter_conn *vde_conn, MngmClient *client) {
+	// Removes the client from the list (the order is not relevant)
+	for (int i=0; i<vde_conn->management.connections_count; i++) {
+		if (vde_conn->management.connections[i] == client) {
+			vde_conn->management.connections_count--;
+			vde_conn->management.connections[i] = vde_conn->management.connections[vde_conn->management.connections_count];
+			break;
+		}
+	}
 
-	return 0;
+	close(client->fd);
+	free(client);
 }
 
 
@@ -122,10 +140,12 @@ static int help(struct vde_wirefilter_conn *vde_conn, int fd, char *arg) {
 	print_mgmt(fd, "help         print a summary of mgmt commands");
 	print_mgmt(fd, "load         load a configuration file");
 	print_mgmt(fd, "showinfo     show status and parameter values");
+	print_mgmt(fd, "stats        show packet counters (reset: then reset them)");
 	print_mgmt(fd, "loss         set loss percentage");
 	print_mgmt(fd, "lostburst    mean length of lost packet bursts");
 	print_mgmt(fd, "delay        set delay ms");
 	print_mgmt(fd, "dup          set dup packet percentage");
+	print_mgmt(fd, "dupmax       set max duplicates of a packet");
 	print_mgmt(fd, "bandwidth    set channel bandwidth bytes/sec");
 	print_mgmt(fd, "speed        set interface speed bytes/sec");
 	print_mgmt(fd, "noise        set noise factor bits/Mbyte");
@@ -170,6 +190,13 @@ static int setDuplicates(struct vde_wirefilter_conn *vde_conn, int fd, char *arg
 	return 0;
 }
 
+static int setDuplicatesMax(struct vde_wirefilter_conn *vde_conn, int fd, char *arg) {
+	(void)fd;
+	if (*arg == '\0') { return EINVAL; }
+	vde_conn->dup_max = strtoul(arg, NULL, 10);
+	return 0;
+}
+
 static int setBandwidth(struct vde_wirefilter_conn *vde_conn, int fd, char *arg) {
 	(void)fd;
 	setWireValue(vde_conn, BANDWIDTH, arg, 0);
@@ -202,19 +229,20 @@ static int setChanbufsize(struct vde_wirefilter_conn *vde_conn, int fd, char *ar
 
 static int setFIFO(struct vde_wirefilter_conn *vde_conn, int fd, char *arg) {
 	(void)fd;
-	vde_conn->queue.fifoness = atoi(arg);
-	return 0;
+	return (setQueueFifoness(vde_conn, atoi(arg) ? FIFO : NO_FIFO) == 0) ? 0 : ENOMEM;
 }
 
 static int markovSetNodeNumber(struct vde_wirefilter_conn *vde_conn, int fd, char *arg) {
 	(void)fd;
-	markovResize(vde_conn, atoi(arg));
-	return 0;
+	return (markovResize(vde_conn, atoi(arg)) == 0) ? 0 : EINVAL;
 }
 
 static int markovSetCurrentNode(struct vde_wirefilter_conn *vde_conn, int fd, char *arg) {
 	(void)fd;
-	vde_conn->markov.current_node = atoi(arg);
+	int node = atoi(arg);
+	if (node < 0 || node >= vde_conn->markov.nodes_count) { return EINVAL; }
+
+	vde_conn->markov.current_node = node;
 	return 0;
 }
 
@@ -227,7 +255,7 @@ static int markovSetNodeName(struct vde_wirefilter_conn *vde_conn, int fd, char
 static int markovSetTime(struct vde_wirefilter_conn *vde_conn, int fd, char *arg) {
 	(void)fd;
 	vde_conn->markov.change_frequency = MS_TO_NS(atoll(arg));
-	setTimer(vde_conn->markov.timerfd, vde_conn->markov.change_frequency);
+	markovSetTimer(vde_conn, 1);
 	return 0;
 }
 
@@ -237,6 +265,16 @@ static int markovSetEdge(struct vde_wirefilter_conn *vde_conn, int fd, char *arg
 	return 0;
 }
 
+static void printEdge(struct vde_wirefilter_conn *vde_conn, int fd, const int from, const int to, const double weight) {
+	print_mgmt(
+		fd, "Edge (%-2d)->(%-2d) \"%s\"->\"%s\" weight %lg",
+		from, to,
+		MARKOV_GET_NODE(vde_conn, from)->name ? MARKOV_GET_NODE(vde_conn, from)->name : "",
+		MARKOV_GET_NODE(vde_conn, to)->name ? MARKOV_GET_NODE(vde_conn, to)->name : "",
+		weight
+	);
+}
+
 static int markovShowEdges(struct vde_wirefilter_conn *vde_conn, int fd, char *arg) {
 	int to_explore_node = (*arg != 0) ? atoi(arg) : vde_conn->markov.current_node;
 	
@@ -244,17 +282,20 @@ static int markovShowEdges(struct vde_wirefilter_conn *vde_conn, int fd, char *a
 		return EINVAL;
 	}
 
-	for (int i=0; i<vde_conn->markov.nodes_count; i++) {
-		if (ADJMAP(vde_conn, to_explore_node, i) != 0) {
-			print_mgmt(
-				fd, "Edge (%-2d)->(%-2d) \"%s\"->\"%s\" weight %lg",
-				to_explore_node, i,
-				MARKOV_GET_NODE(vde_conn, to_explore_node)->name ? MARKOV_GET_NODE(vde_conn, to_explore_node)->name : "",
-				MARKOV_GET_NODE(vde_conn, i)->name ? MARKOV_GET_NODE(vde_conn, i)->name : "",
-				ADJMAP(vde_conn, to_explore_node, i)
-			);
+	markovCommit(vde_conn); // The loopback edge of nodes modified by an rc file being loaded
+	MarkovNode *node = MARKOV_GET_NODE(vde_conn, to_explore_node);
+	char loopback_shown = (node->loopback == 0);
+
+	// Edges are sorted by target, the loopback edge is shown in its position
+	for (int i=0; i<=node->edges_count; i++) {
+		if (!loopback_shown && (i == node->edges_count || node->edges[i].target > to_explore_node)) {
+			printEdge(vde_conn, fd, to_explore_node, to_explore_node, node->loopback);
+			loopback_shown = 1;
 		}
-	} 
+		if (i < node->edges_count) {
+			printEdge(vde_conn, fd, to_explore_node, node->edges[i].target, node->edges[i].weight);
+		}
+	}
 
 	return 0;
 }
@@ -276,8 +317,8 @@ static int markovSetDebugLevel(struct vde_wirefilter_conn *vde_conn, int fd, cha
 
 
 	for (int i=0; i<vde_conn->management.connections_count; i++) {
-		if (vde_conn->management.connections[i] == fd) {
-			vde_conn->management.debug_level[i] = debug_level;
+		if (vde_conn->management.connections[i]->fd == fd) {
+			vde_conn->management.connections[i]->debug_level = debug_level;
 			return 0;
 		}
 	}
@@ -329,14 +370,99 @@ static int showInfo(struct vde_wirefilter_conn *vde_conn, int fd, char *arg) {
 					WIRE_FIELDS(MARKOV_GET_NODE(vde_conn, to_show_node), CHANBUFSIZE, LEFT_TO_RIGHT), 
 					WIRE_FIELDS(MARKOV_GET_NODE(vde_conn, to_show_node), CHANBUFSIZE, RIGHT_TO_LEFT));
 
-	print_mgmt(fd, "Current Delay Queue size:   L->R %d      R->L %d   ", vde_conn->queue.byte_size[LEFT_TO_RIGHT], vde_conn->queue.byte_size[RIGHT_TO_LEFT]);
+	print_mgmt(fd, "Current Delay Queue size:   L->R %d      R->L %d   ", vde_conn->queue.dir[LEFT_TO_RIGHT].byte_size, vde_conn->queue.dir[RIGHT_TO_LEFT].byte_size);
+	print_mgmt(fd,"Max duplicates of a packet %u", vde_conn->dup_max);
 	print_mgmt(fd,"Fifoness %s",(vde_conn->queue.fifoness == FIFO) ? "TRUE" : "FALSE");
-	print_mgmt(fd,"Waiting packets in delay queues %d", vde_conn->queue.size);
+	print_mgmt(fd,"Delay queue engine %s", vde_conn->queue.dir[LEFT_TO_RIGHT].engine->name);
+	print_mgmt(fd,"Delay queue timer slack %.1fus", NS_TO_US((double)vde_conn->queue.timer_slack));
+	print_mgmt(fd,"Speed mode %s", (vde_conn->speed_mode == SPEED_MODE_NONBLOCK) ? "nonblock" : "block");
+	print_mgmt(fd,"Waiting packets in delay queues %d", vde_conn->queue.dir[LEFT_TO_RIGHT].size + vde_conn->queue.dir[RIGHT_TO_LEFT].size);
+	print_mgmt(fd,"Clock source %s", clockSourceName());
+	print_mgmt(fd,"Random seed %" PRIu64, vde_conn->random.seed);
+	for (int i=LEFT_TO_RIGHT; i<=RIGHT_TO_LEFT; i++) {
+		DelayQueue *queue = &vde_conn->queue.dir[i];
+		print_mgmt(fd,"Queue timer overshoot %s: avg %.1fus max %.1fus (%" PRIu64 " wake ups)", (i == LEFT_TO_RIGHT) ? "L->R" : "R->L",
+					queue->overshoot.samples ? NS_TO_US((double)queue->overshoot.total_ns / queue->overshoot.samples) : 0.0,
+					NS_TO_US((double)queue->overshoot.max_ns), queue->overshoot.samples);
+	}
+	pthread_mutex_lock(&vde_conn->pool.lock);
+	print_mgmt(fd,"Packet pool: buffers %u in use %u (max %u)", vde_conn->pool.capacity, poolInUse(&vde_conn->pool), vde_conn->pool.high_water);
+	print_mgmt(fd,"Packet pool: hits %" PRIu64 " misses %" PRIu64, poolHits(&vde_conn->pool), vde_conn->pool.misses);
+	pthread_mutex_unlock(&vde_conn->pool.lock);
 	if (vde_conn->blink.socket_fd > 0) {
-		vde_conn->blink.message[vde_conn->blink.id_len] = '\0';
-		print_mgmt(fd,"Blink socket: %s", vde_conn->blink.socket_info.sun_path);
-		print_mgmt(fd,"Blink id:     %s", vde_conn->blink.message);
-		vde_conn->blink.message[vde_conn->blink.id_len] = ' ';
+		Blink *blink = &vde_conn->blink;
+		print_mgmt(fd,"Blink socket: %s", blink->socket_info.sun_path);
+		print_mgmt(fd,"Blink id:     %s", blink->id);
+		if (blink->mode == BLINK_MODE_SAMPLE) { print_mgmt(fd,"Blink mode:   %s (1 every %u packets)", blinkModeName(blink), blink->sample); }
+		else if (blink->mode == BLINK_MODE_AGGREGATE) { print_mgmt(fd,"Blink mode:   %s (every %" PRIu64 " ms)", blinkModeName(blink), NS_TO_MS(blink->interval)); }
+		else { print_mgmt(fd,"Blink mode:   %s", blinkModeName(blink)); }
+		print_mgmt(fd,"Blink lost messages: %" PRIu64 " (ring full) %" PRIu64 " (no listener)",
+					__atomic_load_n(&blink->dir[LEFT_TO_RIGHT].lost, __ATOMIC_RELAXED) + __atomic_load_n(&blink->dir[RIGHT_TO_LEFT].lost, __ATOMIC_RELAXED), blink->unsent);
+	}
+
+	return 0;
+}
+
+static void printStatsRow(int fd, const char *name, const uint64_t lr, const uint64_t rl) {
+	print_mgmt(fd, "%-22s %20" PRIu64 " %20" PRIu64, name, lr, rl);
+}
+
+/* Shows the dataplane counters, with "reset" they are reset once shown */
+static int showStats(struct vde_wirefilter_conn *vde_conn, int fd, char *arg) {
+	static const char *drop_names[DROP_REASONS] = {
+		"Dropped (mtu)", "Dropped (loss)", "Dropped (lostburst)", "Dropped (chanbufsize)", "Dropped (pool)", "Dropped (ring)"
+	};
+	WireStats *lr = &vde_conn->stats[LEFT_TO_RIGHT];
+	WireStats *rl = &vde_conn->stats[RIGHT_TO_LEFT];
+	char reset = (strcmp(arg, "reset") == 0);
+
+	if (*arg != '\0' && !reset) { return EINVAL; }
+
+	print_mgmt(fd, "%-22s %20s %20s", "", "L->R", "R->L");
+	printStatsRow(fd, "Packets in", lr->packets_in, rl->packets_in);
+	printStatsRow(fd, "Bytes in", lr->bytes_in, rl->bytes_in);
+	printStatsRow(fd, "Packets out", lr->packets_out, rl->packets_out);
+	printStatsRow(fd, "Bytes out", lr->bytes_out, rl->bytes_out);
+	printStatsRow(fd, "Duplicates", lr->duplicates, rl->duplicates);
+	printStatsRow(fd, "Flipped bits", lr->flipped_bits, rl->flipped_bits);
+	for (int i=0; i<DROP_REASONS; i++) {
+		printStatsRow(fd, drop_names[i], __atomic_load_n(&lr->drops[i], __ATOMIC_RELAXED), __atomic_load_n(&rl->drops[i], __ATOMIC_RELAXED));
+	}
+	printStatsRow(fd, "Queue max packets", vde_conn->queue.dir[LEFT_TO_RIGHT].high_water.size, vde_conn->queue.dir[RIGHT_TO_LEFT].high_water.size);
+	printStatsRow(fd, "Queue max bytes", vde_conn->queue.dir[LEFT_TO_RIGHT].high_water.byte_size, vde_conn->queue.dir[RIGHT_TO_LEFT].high_water.byte_size);
+
+	// Lateness of the release of the delayed packets
+	const Histogram *lr_lateness = &vde_conn->queue.dir[LEFT_TO_RIGHT].lateness;
+	const Histogram *rl_lateness = &vde_conn->queue.dir[RIGHT_TO_LEFT].lateness;
+	printStatsRow(fd, "Released packets", lr_lateness->total, rl_lateness->total);
+	printStatsRow(fd, "Lateness p50 (ns)", histogramPercentile(lr_lateness, 50), histogramPercentile(rl_lateness, 50));
+	printStatsRow(fd, "Lateness p99 (ns)", histogramPercentile(lr_lateness, 99), histogramPercentile(rl_lateness, 99));
+	printStatsRow(fd, "Lateness p99.9 (ns)", histogramPercentile(lr_lateness, 99.9), histogramPercentile(rl_lateness, 99.9));
+	printStatsRow(fd, "Lateness max (ns)", lr_lateness->max, rl_lateness->max);
+
+	// Deadlines are served by a single timer for each handler thread, rate since the last reset
+	uint64_t timer_syscalls = 0;
+	double elapsed_s = (now_ns() - vde_conn->stats_since) / 1e9;
+	for (int i=0; i<vde_conn->handlers_count; i++) { timer_syscalls += __atomic_load_n(&vde_conn->handlers[i].loop.timer_syscalls, __ATOMIC_RELAXED); }
+	print_mgmt(fd, "%-22s %20" PRIu64 " (%.0f/s, %d timers)", "Timer syscalls", timer_syscalls, timer_syscalls / elapsed_s, vde_conn->handlers_count);
+
+	if (reset) {
+		// Packet handlers are excluded by the wire lock, except for the atomic drops
+		for (int i=LEFT_TO_RIGHT; i<=RIGHT_TO_LEFT; i++) {
+			WireStats *stats = &vde_conn->stats[i];
+			DelayQueue *queue = &vde_conn->queue.dir[i];
+
+			stats->packets_in = stats->bytes_in = 0;
+			stats->packets_out = stats->bytes_out = 0;
+			stats->duplicates = stats->flipped_bits = 0;
+			for (int j=0; j<DROP_REASONS; j++) { __atomic_store_n(&stats->drops[j], 0, __ATOMIC_RELAXED); }
+
+			queue->high_water.size = queue->size;
+			queue->high_water.byte_size = queue->byte_size;
+			histogramReset(&queue->lateness);
+		}
+		for (int i=0; i<vde_conn->handlers_count; i++) { __atomic_store_n(&vde_conn->handlers[i].loop.timer_syscalls, 0, __ATOMIC_RELAXED); }
+		vde_conn->stats_since = now_ns();
 	}
 
 	return 0;
@@ -360,9 +486,11 @@ static struct comlist {
 	{ "help", 			help, 			WITHFILE },
 	{ "load", 			loadConfig, 	WITHFILE },
 	{ "showinfo", 		showInfo, 		WITHFILE },
+	{ "stats", 			showStats, 		WITHFILE },
 	{ "loss", 			setLoss, 		0 },
 	{ "lostburst", 		setBurstyLoss,	0 },
 	{ "delay", 			setDelay, 		0 },
+	{ "dupmax", 		setDuplicatesMax, 0 }, // Before "dup", commands are matched by prefix
 	{ "dup", 			setDuplicates, 	0 },
 	{ "bandwidth", 		setBandwidth, 	0 },
 	{ "speed", 			setSpeed, 		0 },
@@ -450,18 +578,91 @@ int handleManagementCommand(struct vde_wirefilter_conn *vde_conn, int socket_fd)
 	return ret_value;
 }
 
+/**
+ * Executes the commands of an rc file.
+ * The file is mapped and parsed in place (lines have no length limit), the Markov nodes
+ * modified by the commands are rebuilt once at the end (or when the wire lock is released).
+*/
 int loadConfig(struct vde_wirefilter_conn *vde_conn, int fd, char *rc_path) {
-	FILE *f = fopen(rc_path, "r");
-	handle_error( f == NULL, { return -1; }, "Error while opening rc file: %s", strerror(errno) );
-	char buf[MNGM_CMD_MAX_LEN];
+	uint64_t start = now_ns();
+	struct stat rc_info;
+	char *data = NULL;
+
+	int result = 0;
+
+	// As for the other commands, the result is an errno value
+	int rc_fd = open(rc_path, O_RDONLY | O_CLOEXEC);
+	if (rc_fd < 0 || fstat(rc_fd, &rc_info) < 0) { goto file_error; }
+
+	size_t size = rc_info.st_size;
+	if (size > 0) {
+		// Private mapping, the lines are terminated in place without changing the file
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, rc_fd, 0);
+		if (data == MAP_FAILED) { goto file_error; }
+		madvise(data, size, MADV_SEQUENTIAL);
+	}
+	close(rc_fd);
+
+	/*
+		When the handler threads are running, the load is a management command executed with the wire lock held.
+		With dirthreads the lock is released between batches of lines, so that the other threads keep
+		handling the packets. A single handler thread is busy with the load until its end.
+	*/
+	char release_lock = (vde_conn->handlers_count > 0);
+	unsigned long lines = 0, applied = 0;
+	char *last_line = NULL;
+	char *line = data, *end = data + size;
+
+	markovDefer(vde_conn, 1);
+	while (line < end) {
+		char *cmd = line;
+		char *eol = memchr(line, '\n', end - line);
+
+		if (eol != NULL) {
+			*eol = '\0';
+			line = eol + 1;
+		}
+		else {
+			// The mapping may have no room for the terminator of the last line
+			cmd = last_line = strndup(line, end - line);
+			if (last_line == NULL) { // A break in the action of handle_error would not leave the loop
+				print_log(LOG_ERR, "rc file line malloc error");
+				result = ENOMEM;
+				break;
+			}
+			line = end;
+		}
 
-	while (fgets(buf, MNGM_CMD_MAX_LEN, f) != NULL) {
 		if (fd >= 0) {
-			print_mgmt(fd,"%s (%s) %s", prompt, rc_path, buf);
+			print_mgmt(fd,"%s (%s) %s", prompt, rc_path, cmd);
+		}
+		if (executeCommand(vde_conn, fd, cmd) == 0) { applied++; }
+		lines++;
+
+		// Lets the packets flow during long loads
+		if (release_lock && lines % RC_LINES_PER_LOCK == 0) {
+			markovCommit(vde_conn);
+			pthread_rwlock_unlock(&vde_conn->wire_lock);
+			pthread_rwlock_wrlock(&vde_conn->wire_lock);
 		}
-		executeCommand(vde_conn, fd, buf);
 	}
+	markovDefer(vde_conn, 0);
 
-	fclose(f);
-	return 0;
+	free(last_line);
+	if (data != NULL) { munmap(data, size); }
+
+	double load_ms = NS_TO_MS((double)(now_ns() - start));
+	const char *outcome = (result == 0) ? "" : ", load interrupted";
+	print_log((result == 0) ? LOG_INFO : LOG_ERR, "rc file %s: %lu of %lu lines applied in %.1f ms%s", rc_path, applied, lines, load_ms, outcome);
+	if (fd >= 0) {
+		print_mgmt(fd, "rc file %s: %lu of %lu lines applied in %.1f ms%s", rc_path, applied, lines, load_ms, outcome);
+	}
+
+	return result;
+
+	file_error:
+		result = errno;
+		print_log(LOG_ERR, "Error while reading rc file %s: %s", rc_path, strerror(result));
+		if (rc_fd >= 0) { close(rc_fd); }
+		return result;
 }
\ No newline at end of file
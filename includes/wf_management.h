@@ -2,15 +2,25 @@
 #define INCLUDE_MANAGEMENT
 
 #include "./wf_conn.h"
+#include "./wf_loop.h"
 
 #define MNGM_CMD_MAX_LEN 128
+#define MNGM_CLIENTS_CHUNK 4 // Client slots allocated each time the list grows
+
+
+struct mngm_client_t {
+	int fd;
+	int debug_level;
+	EventHandler handler; // Registration in the event loop
+};
+typedef struct mngm_client_t MngmClient;
 
 int initManagement(struct vde_wirefilter_conn *vde_conn, char *socket_path, char *mode_str);
 void closeManagement(struct vde_wirefilter_conn *vde_conn);
 
 int createManagementSocket(struct vde_wirefilter_conn *vde_conn, char *socket_name);
-int acceptManagementConnection(struct vde_wirefilter_conn *vde_conn);
-int closeManagementConnection(struct vde_wirefilter_conn *vde_conn, int socket_fd);
+MngmClient *acceptManagementConnection(struct vde_wirefilter_conn *vde_conn);
+void closeManagementConnection(struct vde_wirefilter_conn *vde_conn, MngmClient *client);
 
 int handleManagementCommand(struct vde_wirefilter_conn *vde_conn, int socket_fd);
 int loadConfig(struct vde_wirefilter_conn *vde_conn, int fd, char *rc_path);
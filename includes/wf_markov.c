@@ -3,43 +3,208 @@
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/timerfd.h>
 #include <unistd.h>
 #include "./wf_conn.h"
 #include "./wf_time.h"
 #include "./wf_management.h"
 #include "./wf_log.h"
 
+static void compileNode(MarkovNode *node, const int direction);
+
 
 int initMarkov(struct vde_wirefilter_conn *vde_conn, const int size, const int start_node, const uint64_t change_frequency) {
 	handle_error( markovResize(vde_conn, size <= 0 ? 1 : size) < 0, { return -1; }, NULL );
 	vde_conn->markov.current_node = start_node;
-	vde_conn->markov.timerfd = timerfd_create(CLOCK_REALTIME, 0);
-	handle_error( vde_conn->markov.timerfd < 0, { return -1; }, "Markov timer fd init error: %s",  strerror(errno) );
+	vde_conn->markov.timer = (LoopTimer){ 0 };
 	vde_conn->markov.change_frequency = change_frequency;
 
 	return 0;
 }
 
+static void freeNode(MarkovNode *node) {
+	free(node->name);
+	free(node->edges);
+	free(node->alias);
+}
+
 void closeMarkov(struct vde_wirefilter_conn *vde_conn) {
+	for (int i=0; i<vde_conn->markov.nodes_count; i++) { freeNode(MARKOV_GET_NODE(vde_conn, i)); }
 	free(vde_conn->markov.nodes);
-	free(vde_conn->markov.adjacency);
-	close(vde_conn->markov.timerfd);
+	free(vde_conn->markov.modified);
 }
 
 
-/* Rebalances the edges of a node */
-static void markovRebalanceNode(struct vde_wirefilter_conn *vde_conn, const int node) {
-	ADJMAP(vde_conn, node, node) = 100.0;
+/**
+ * Rebuilds the loopback weight and the alias table of a node, in O(edges).
+ * Negative weights (edges exceeding 100%) are ignored and the others are normalized.
+*/
+static int markovRebuildNode(MarkovNode *node, const int node_id) {
+	int k = node->edges_count + 1;
+	double total = 0;
+
+	node->loopback = 100.0;
+	for (int i=0; i<node->edges_count; i++) { node->loopback -= node->edges[i].weight; }
+
+	AliasEntry *alias = realloc(node->alias, k * sizeof(AliasEntry));
+	int *worklist = malloc(k * sizeof(int));
+	handle_error( alias == NULL || worklist == NULL, { free(worklist); return -1; }, "Markov alias malloc error" );
+	node->alias = alias;
+
+	for (int i=0; i<k; i++) {
+		alias[i].node = (i < node->edges_count) ? node->edges[i].target : node_id;
+		alias[i].alias = alias[i].node;
+		alias[i].probability = (i < node->edges_count) ? node->edges[i].weight : node->loopback;
+		if (alias[i].probability < 0) { alias[i].probability = 0; }
+		total += alias[i].probability;
+	}
+
+	// Without outgoing probability the chain stays on the node
+	if (total <= 0) {
+		for (int i=0; i<k; i++) { alias[i] = (AliasEntry){ 1.0, node_id, node_id }; }
+		free(worklist);
+		return 0;
+	}
+
+	// Small columns are pushed at the beginning of the worklist, large ones at the end
+	int small = 0, large = k;
+	for (int i=0; i<k; i++) {
+		alias[i].probability = alias[i].probability * k / total;
 
-	for (int i=1; i<vde_conn->markov.nodes_count; i++) {
-		ADJMAP(vde_conn, node, node) -= ADJMAP(vde_conn, node, (node + i) % vde_conn->markov.nodes_count);
+		if (alias[i].probability < 1.0) { worklist[small++] = i; }
+		else { worklist[--large] = i; }
 	}
+
+	// Each small column is filled up with a large one
+	while (small > 0 && large < k) {
+		int s = worklist[--small];
+		int l = worklist[large++];
+
+		alias[s].alias = alias[l].node;
+		alias[l].probability -= 1.0 - alias[s].probability;
+
+		if (alias[l].probability < 1.0) { worklist[small++] = l; }
+		else { worklist[--large] = l; }
+	}
+
+	// Leftovers are full up to rounding errors
+	while (small > 0) { alias[worklist[--small]].probability = 1.0; }
+	while (large < k) { alias[worklist[large++]].probability = 1.0; }
+
+	free(worklist);
+	return 0;
+}
+
+/* Returns the position of the edge towards target, or the position where it should be inserted */
+static int findEdge(const MarkovNode *node, const int target) {
+	int low = 0, high = node->edges_count;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (node->edges[mid].target < target) { low = mid + 1; }
+		else { high = mid; }
+	}
+
+	return low;
+}
+
+/* Sets the weight of an edge, null weights remove the edge */
+static int markovSetEdge(MarkovNode *node, const int target, const double weight) {
+	int pos = findEdge(node, target);
+	char found = (pos < node->edges_count && node->edges[pos].target == target);
+
+	if (found && weight == 0) {
+		memmove(&node->edges[pos], &node->edges[pos+1], (node->edges_count - pos - 1) * sizeof(MarkovEdge));
+		node->edges_count--;
+	}
+	else if (found) {
+		node->edges[pos].weight = weight;
+	}
+	else if (weight != 0) {
+		if (node->edges_count >= node->edges_size) {
+			int new_size = (node->edges_size > 0) ? 2*node->edges_size : MARKOV_EDGES_CHUNK;
+			MarkovEdge *edges = realloc(node->edges, new_size * sizeof(MarkovEdge));
+			handle_error( edges == NULL, { return -1; }, "Markov edges malloc error" );
+			node->edges = edges;
+			node->edges_size = new_size;
+		}
+
+		memmove(&node->edges[pos+1], &node->edges[pos], (node->edges_count - pos) * sizeof(MarkovEdge));
+		node->edges[pos] = (MarkovEdge){ target, weight };
+		node->edges_count++;
+	}
+
+	return 0;
+}
+
+/* Applies the pending updates of a node */
+static void applyNode(MarkovNode *node, const int node_id) {
+	if (node->modified & MARKOV_MODIFIED_EDGES) { markovRebuildNode(node, node_id); }
+	if (node->modified & MARKOV_MODIFIED_VALUES) {
+		compileNode(node, LEFT_TO_RIGHT);
+		compileNode(node, RIGHT_TO_LEFT);
+	}
+	node->modified = 0;
+}
+
+/* Marks a node as modified, its updates are applied by markovCommit */
+static void markovTouch(struct vde_wirefilter_conn *vde_conn, const int node_id, const char flags) {
+	MarkovNode *node = MARKOV_GET_NODE(vde_conn, node_id);
+
+	if (node->modified == 0) {
+		if (vde_conn->markov.modified_count >= vde_conn->markov.modified_size) {
+			int new_size = (vde_conn->markov.modified_size > 0) ? 2*vde_conn->markov.modified_size : MARKOV_EDGES_CHUNK;
+			int *new_modified = realloc(vde_conn->markov.modified, new_size * sizeof(int));
+			// The update cannot be deferred
+			handle_error( new_modified == NULL, { node->modified = flags; applyNode(node, node_id); return; }, "Markov pending updates malloc error" );
+			vde_conn->markov.modified = new_modified;
+			vde_conn->markov.modified_size = new_size;
+		}
+		vde_conn->markov.modified[vde_conn->markov.modified_count++] = node_id;
+	}
+
+	node->modified |= flags;
+}
+
+/**
+ * Defers the rebuild of the modified nodes (e.g. while loading an rc file) until markovCommit.
+ * Stopping the deferral commits the pending updates.
+*/
+void markovDefer(struct vde_wirefilter_conn *vde_conn, const char defer) {
+	vde_conn->markov.deferred = defer;
+	if (!defer) { markovCommit(vde_conn); }
+}
+
+/* Rebuilds each modified node once */
+void markovCommit(struct vde_wirefilter_conn *vde_conn) {
+	for (int i=0; i<vde_conn->markov.modified_count; i++) {
+		int node_id = vde_conn->markov.modified[i];
+		applyNode(MARKOV_GET_NODE(vde_conn, node_id), node_id);
+	}
+	vde_conn->markov.modified_count = 0;
+}
+
+/* Parses "node1,node2,weight" (sscanf would scan the whole remaining string on each edge) */
+static int parseEdge(const char *edge_str, int *start_node, int *end_node, double *weight) {
+	char *end;
+
+	*start_node = strtol(edge_str, &end, 10);
+	if (end == edge_str || *end != ',') { return -1; }
+	edge_str = end + 1;
+
+	*end_node = strtol(edge_str, &end, 10);
+	if (end == edge_str || *end != ',') { return -1; }
+	edge_str = end + 1;
+
+	*weight = strtod(edge_str, &end);
+	if (end == edge_str) { return -1; }
+
+	return 0;
 }
 
 /**
  * Parses the string of edges names
  * Format: "node1,node2,weight node1,node2,weight ..."
+ * The loopback edge is always 100% minus the other weights, so it cannot be set.
 */
 void markovSetEdges(struct vde_wirefilter_conn *vde_conn, char *edges_str) {
 	int start_node, end_node;
@@ -49,13 +214,19 @@ void markovSetEdges(struct vde_wirefilter_conn *vde_conn, char *edges_str) {
 		while ((*edges_str == ' ' || *edges_str == '\n' || *edges_str == '\t') && *edges_str != '\0') { edges_str++; }
 		if (*edges_str == '\0') { break; }
 
-		sscanf(edges_str, "%d,%d,%lf", &start_node, &end_node, &weight);
-		ADJMAP(vde_conn, start_node, end_node) = weight;
-		markovRebalanceNode(vde_conn, start_node);
+		if (parseEdge(edges_str, &start_node, &end_node, &weight) == 0 && start_node != end_node &&
+			start_node >= 0 && start_node < vde_conn->markov.nodes_count && end_node >= 0 && end_node < vde_conn->markov.nodes_count) {
+			MarkovNode *node = MARKOV_GET_NODE(vde_conn, start_node);
+
+			// The node is rebuilt only once all the edges are set
+			if (markovSetEdge(node, end_node, weight) == 0) { markovTouch(vde_conn, start_node, MARKOV_MODIFIED_EDGES); }
+		}
 
 		// Moves to the next edge value
 		while (*edges_str != ' ' && *edges_str != '\0') { edges_str++; }
 	}
+
+	if (!vde_conn->markov.deferred) { markovCommit(vde_conn); }
 }
 
 /**
@@ -86,9 +257,9 @@ void markovSetNames(struct vde_wirefilter_conn *vde_conn, char *names_str) {
 		*name_end = '\0';
 
 		// Sets name
-		if (node < vde_conn->markov.nodes_count) {
-			if (vde_conn->markov.nodes[node]->name) { free(vde_conn->markov.nodes[node]->name); }
-			vde_conn->markov.nodes[node]->name = strdup(names_str);
+		if (node >= 0 && node < vde_conn->markov.nodes_count) {
+			if (MARKOV_GET_NODE(vde_conn, node)->name) { free(MARKOV_GET_NODE(vde_conn, node)->name); }
+			MARKOV_GET_NODE(vde_conn, node)->name = strdup(names_str);
 		}
 		
 		// Restores and repositions string
@@ -98,90 +269,68 @@ void markovSetNames(struct vde_wirefilter_conn *vde_conn, char *names_str) {
 	}
 }
 
-static void copyAdjacency(struct vde_wirefilter_conn *vde_conn, const int new_size, double *new_map) {
-	for (int i=0; i<new_size; i++) {
-		// Begins with an edge to itself (the node is not connected to anything)
-		ADJMAPN(new_map, i, i, new_size) = 100.0;
-		
-		for (int j=1; j<new_size; j++) {
-			int real_j = (i+j) % new_size; // Since i may not be at the first column of the adjacency map
-
-			// The adjacency exists in the old map
-			if ( (i < vde_conn->markov.nodes_count) && (real_j < vde_conn->markov.nodes_count) ) {
-				ADJMAPN(new_map, i, real_j, new_size) = ADJMAP(vde_conn, i, real_j);
-				ADJMAPN(new_map, i, i, new_size) -= ADJMAPN(new_map, i, real_j, new_size);
-			}
-		}
-	}
-}
-
 /**
  * Increases or decreases the size of the Markov chain
 */
 int markovResize(struct vde_wirefilter_conn *vde_conn, const int new_nodes_count) {
-	if (vde_conn->markov.nodes_count == new_nodes_count) { return 0; }
-	
-	// The current number of nodes is insufficient
-	if (vde_conn->markov.nodes_count < new_nodes_count) {
-		// Creates new nodes
-		vde_conn->markov.nodes = realloc(vde_conn->markov.nodes, new_nodes_count*(sizeof(struct markov_node *)));
-		handle_error(vde_conn->markov.nodes == NULL, { return -1; }, "Markov resize error");
-		
-		for (int i=vde_conn->markov.nodes_count; i<new_nodes_count; i++) {
-			vde_conn->markov.nodes[i] = calloc(1, sizeof(MarkovNode));
-			handle_error(vde_conn->markov.nodes[i] == NULL, { return -1; }, "Markov resize error");
-		}
-	} 
-	else { 
-		// Removes exceeding nodes
-		for (int i=new_nodes_count;i<vde_conn->markov.nodes_count;i++) {
-			free(vde_conn->markov.nodes[i]);
-		}
-		vde_conn->markov.nodes = realloc(vde_conn->markov.nodes, new_nodes_count*(sizeof(struct markov_node *)));
-		handle_error(vde_conn->markov.nodes == NULL, { return -1; }, "Markov resize error");
+	int old_nodes_count = vde_conn->markov.nodes_count;
+	if (old_nodes_count == new_nodes_count) { return 0; }
+	handle_error(new_nodes_count <= 0, { return -1; }, "Markov chain needs at least a node");
+	markovCommit(vde_conn); // Pending nodes may be deleted
+
+	// Removes exceeding nodes
+	for (int i=new_nodes_count; i<old_nodes_count; i++) { freeNode(MARKOV_GET_NODE(vde_conn, i)); }
+
+	// When shrinking the old array can still be used
+	MarkovNode *nodes = realloc(vde_conn->markov.nodes, new_nodes_count * sizeof(MarkovNode));
+	handle_error(nodes == NULL && new_nodes_count > old_nodes_count, { return -1; }, "Markov resize error");
+	if (nodes != NULL) { vde_conn->markov.nodes = nodes; }
+	vde_conn->markov.nodes_count = new_nodes_count;
 
-		// Places the current node on a valid node
-		if (vde_conn->markov.current_node >= new_nodes_count) {
-			vde_conn->markov.current_node = 0;
-		}
+	// New nodes do not have edges (i.e. a loopback edge of 100%)
+	for (int i=old_nodes_count; i<new_nodes_count; i++) {
+		memset(MARKOV_GET_NODE(vde_conn, i), 0, sizeof(MarkovNode));
+		handle_error(markovRebuildNode(MARKOV_GET_NODE(vde_conn, i), i) < 0, { return -1; }, "Markov resize error");
+	}
+
+	// Edges towards deleted nodes (at the end of the sorted lists) are added to the loopback edge
+	for (int i=0; i<new_nodes_count && new_nodes_count < old_nodes_count; i++) {
+		MarkovNode *node = MARKOV_GET_NODE(vde_conn, i);
+		int kept = findEdge(node, new_nodes_count);
+		if (kept == node->edges_count) { continue; }
+
+		node->edges_count = kept;
+		handle_error(markovRebuildNode(node, i) < 0, { return -1; }, "Markov resize error");
+	}
+
+	// Places the current node on a valid node
+	if (vde_conn->markov.current_node >= new_nodes_count) {
+		vde_conn->markov.current_node = 0;
 	}
-	
-	double *new_adjacency_map = calloc(new_nodes_count*new_nodes_count, sizeof(double));
-	handle_error(new_adjacency_map == NULL, { return -1; }, "Markov resize error");
-	copyAdjacency(vde_conn, new_nodes_count, new_adjacency_map);
-	
-	// Updates Markov information
-	if (vde_conn->markov.adjacency) { free(vde_conn->markov.adjacency); }
-	vde_conn->markov.adjacency = new_adjacency_map;
-	vde_conn->markov.nodes_count = new_nodes_count;
 
 	return 0;
 }
 
 
-/* Changes Markov state */
+/* Changes Markov state, in O(1) with the alias table of the node */
 void markovStep(struct vde_wirefilter_conn *vde_conn, const int start_node) {
-	double probability = drand48() * 100;
-	int new_node = 0;
-	
-	for (int j=0; j<vde_conn->markov.nodes_count; j++) {
-		new_node = (start_node + j) % vde_conn->markov.nodes_count;
-		double change_probability = ADJMAP(vde_conn, start_node, new_node);
-		
-		if (change_probability >= probability) {
-			break;
-		}
-		else {
-			probability -= change_probability;
-		}
-	}
+	const MarkovNode *node = MARKOV_GET_NODE(vde_conn, start_node);
+	int k = node->edges_count + 1;
+
+	// A single uniform chooses both the column (integer part) and the coin (fractional part)
+	double u = randomUniform(&vde_conn->random.markov) * k;
+	int column = (int)u;
+	if (column >= k) { column = k - 1; }
+
+	const AliasEntry *entry = &node->alias[column];
+	int new_node = ((u - column) < entry->probability) ? entry->node : entry->alias;
 
 	// Management debug
 	if (vde_conn->markov.current_node != new_node) {
 		for (int i=0; i<vde_conn->management.connections_count; i++) {
-			if (vde_conn->management.debug_level[i] > 0) {
+			if (vde_conn->management.connections[i]->debug_level > 0) {
 				print_mgmt(
-					vde_conn->management.connections[i], 
+					vde_conn->management.connections[i]->fd, 
 					"%04d Node %d \"%s\" -> %d \"%s\"",
 					3800+new_node,
 					vde_conn->markov.current_node, MARKOV_CURRENT(vde_conn)->name ? MARKOV_CURRENT(vde_conn)->name : "",
@@ -194,6 +343,25 @@ void markovStep(struct vde_wirefilter_conn *vde_conn, const int start_node) {
 	vde_conn->markov.current_node = new_node;
 }
 
+/**
+ * Arms the timer for the next state change.
+ * Deadlines are kept on a fixed grid (missed periods are skipped), unless the period is restarted.
+*/
+void markovSetTimer(struct vde_wirefilter_conn *vde_conn, const char restart) {
+	uint64_t now = now_ns();
+
+	if (vde_conn->markov.change_frequency == 0) {
+		timerCancel(&vde_conn->markov.timer);
+		return;
+	}
+
+	if (restart) { vde_conn->markov.next_change = now; }
+	vde_conn->markov.next_change += vde_conn->markov.change_frequency;
+	if (vde_conn->markov.next_change <= now) { vde_conn->markov.next_change = now + vde_conn->markov.change_frequency; }
+
+	timerSet(&vde_conn->markov.timer, vde_conn->markov.next_change);
+}
+
 
 static int parseWireValueString(char* string, double *value, double *plus, char *algorithm, int *to_set_node) {
 	if (!string) { return -1; }
@@ -254,6 +422,44 @@ static int parseWireValueString(char* string, double *value, double *plus, char
 	return 0;
 }
 
+/* Builds the list of the active stages of a node for a direction, with their precomputed constants */
+static void compileNode(MarkovNode *node, const int direction) {
+	Pipeline *pipeline = &node->pipeline[direction];
+	memset(pipeline, 0, sizeof(Pipeline));
+
+	for (int tag=0; tag<MARKOV_NODE_VALUES; tag++) {
+		pipeline->value[tag] = node->value[tag][direction];
+		
+		// Same activation conditions of the handlers
+		char active = (tag == MTU) ? (minWireValue(node, tag, direction) > 0) :
+					  (tag == CHANBUFSIZE) ? (maxWireValue(node, tag, direction) != 0) :
+					  (maxWireValue(node, tag, direction) > 0);
+		if (!active) { continue; }
+
+		pipeline->active |= STAGE(tag);
+		if (node->value[tag][direction].plus != 0) { pipeline->random |= STAGE(tag); }
+
+		double value = node->value[tag][direction].value;
+		switch (tag) {
+			case LOSS: case DUP:			pipeline->constant[tag] = value / 100; break;
+			case BANDWIDTH: case SPEED:		pipeline->constant[tag] = (value > 0) ? 1000 / value : 0; break;
+			case NOISE:						pipeline->constant[tag] = NOISE_BIT_PROBABILITY(value); break;
+			default:						pipeline->constant[tag] = value; break;
+		}
+	}
+
+	pipeline->mtu = minWireValue(node, MTU, direction);
+	pipeline->total_loss = minWireValue(node, LOSS, direction) >= 100.0;
+
+	if (pipeline->active & STAGE(BURSTYLOSS)) {
+		double loss = pipeline->constant[LOSS];
+		double burst_len = pipeline->constant[BURSTYLOSS];
+
+		pipeline->burst_enter = loss / (burst_len*(1-loss));
+		pipeline->burst_exit = 1.0 / burst_len;
+	}
+}
+
 static void setNodeValue(MarkovNode *node, const int tag, const int direction, const double value, const double plus, const char algorithm) {
 	node->value[tag][direction].value = value;
 	node->value[tag][direction].plus = plus;
@@ -299,20 +505,23 @@ void setWireValue(struct vde_wirefilter_conn *vde_conn, const int tag, char *val
 
 		// Parses the value
 		if (parseWireValueString(value_str, &value, &plus, &algorithm, &to_set_node) == 0) {
-			if (to_set_node < 0 || to_set_node >= vde_conn->markov.nodes_count) { return; }
+			if (to_set_node < 0 || to_set_node >= vde_conn->markov.nodes_count) { break; }
 
 			if (direction == LEFT_TO_RIGHT || direction == BIDIRECTIONAL) {
-				setNodeValue(vde_conn->markov.nodes[to_set_node], tag, LEFT_TO_RIGHT, value, plus, algorithm);
+				setNodeValue(MARKOV_GET_NODE(vde_conn, to_set_node), tag, LEFT_TO_RIGHT, value, plus, algorithm);
 			}
 			if (direction == RIGHT_TO_LEFT || direction == BIDIRECTIONAL) {
-				setNodeValue(vde_conn->markov.nodes[to_set_node], tag, RIGHT_TO_LEFT, value, plus, algorithm);
+				setNodeValue(MARKOV_GET_NODE(vde_conn, to_set_node), tag, RIGHT_TO_LEFT, value, plus, algorithm);
 			}
+			markovTouch(vde_conn, to_set_node, MARKOV_MODIFIED_VALUES);
 		}
 
 		// Restores the string
 		*value_end = old_char;
 		value_str = value_end;
 	}
+
+	if (!vde_conn->markov.deferred) { markovCommit(vde_conn); }
 }
 
 
@@ -331,27 +540,25 @@ double minWireValue(MarkovNode *node, const int tag, const int direction) {
 }
 
 /**
- * Computes the value for the configuration of a given node
+ * Computes the value for the configuration of a given node, the variation is drawn from the given stream
+*/
+double computeWireValue(MarkovNode *node, const int tag, const int direction, Random *rng) {
+	return sampleWireValue(&node->value[tag][direction], rng);
+}
+
+/**
+ * Draws a value from a wire value configuration
 */
-double computeWireValue(MarkovNode *node, const int tag, const int direction) {
-	WireValue *wv = &node->value[tag][direction];
-	
+double sampleWireValue(const WireValue *wv, Random *rng) {
 	if (wv->plus == 0) {
 		return wv->value;
 	}
 
 	switch (wv->algorithm) {
 		case ALGO_UNIFORM:
-			return wv->value + ( wv->plus * ((drand48()*2.0)-1.0) );
-		case ALGO_GAUSS_NORMAL: {
-			double x,y,r2;
-			do {
-				x = (2*drand48()) - 1;
-				y = (2*drand48()) - 1;
-				r2 = x*x + y*y;
-			} while (r2 >= 1.0);
-			return wv->value + ( wv->plus * SIGMA * x * sqrt( (-2 * log(r2)) / r2 ) );
-		}
+			return wv->value + ( wv->plus * ((randomUniform(rng)*2.0)-1.0) );
+		case ALGO_GAUSS_NORMAL:
+			return wv->value + ( wv->plus * SIGMA * randomNormal(rng) );
 		default:
 			return 0.0;
 	}
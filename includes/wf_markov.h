@@ -2,6 +2,7 @@
 #define INCLUDE_MARKOV
 
 #include <stdint.h>
+#include "./wf_random.h"
 
 
 #define DELAY 0
@@ -15,11 +16,14 @@
 #define NOISE 8
 #define MARKOV_NODE_VALUES 9
 
-#define ADJMAPN(M, I, J, N) (M)[(I)*(N)+(J)]
-#define ADJMAP(vde_conn, I, J) ADJMAPN((vde_conn)->markov.adjacency, (I), (J), (vde_conn)->markov.nodes_count)
-#define MARKOV_GET_NODE(vde_conn, node) (vde_conn)->markov.nodes[(node)]
+#define MARKOV_GET_NODE(vde_conn, node) (&(vde_conn)->markov.nodes[(node)])
 #define MARKOV_CURRENT(vde_conn) 		MARKOV_GET_NODE(vde_conn, (vde_conn)->markov.current_node)
 
+#define MARKOV_EDGES_CHUNK 4 // Initial size of the edge lists
+
+#define MARKOV_MODIFIED_EDGES	0x1 // The alias table has to be rebuilt
+#define MARKOV_MODIFIED_VALUES	0x2 // The pipelines have to be compiled
+
 #define WIRE_BIDIRECTIONAL 		0x1
 
 #define ALGO_UNIFORM      0
@@ -30,6 +34,8 @@
 #define MEGA (1<<20)
 #define GIGA (1<<30)
 
+#define NOISE_BIT_PROBABILITY(noise) ((noise) / (8.0*MEGA)) // Noise is in damaged bits per megabyte
+
 #define WIRE_FIELDS(node, tag, direction)	(node->value[tag][direction].value), (node->value[tag][direction].plus), (node->value[tag][direction].algorithm == ALGO_UNIFORM ? 'U' : 'N')
 
 
@@ -39,9 +45,54 @@ typedef struct {
 	char algorithm;
 } WireValue;
 
+#define STAGE(tag) (1U << (tag))
+
+/**
+ * Impairments of a node for a single direction, compiled each time the values of the node change.
+ * Only the active stages are run on the packets.
+*/
+typedef struct {
+	unsigned int active; // Stages to run (bitmask of STAGE(tag))
+	unsigned int random; // Active stages whose value has a random variation
+	WireValue value[MARKOV_NODE_VALUES];
+
+	/*
+		Values of the stages without variation, converted for their use:
+		LOSS and DUP are probabilities, BANDWIDTH and SPEED are in ms per byte, NOISE is the probability of each bit,
+		the others are unchanged
+	*/
+	double constant[MARKOV_NODE_VALUES];
+
+	char total_loss; // Every packet is lost
+	double mtu;
+	double burst_enter; // Probability to enter the faulty state of bursty loss (constant loss and burst length)
+	double burst_exit; // Probability to exit the faulty state of bursty loss (constant burst length)
+} Pipeline;
+
+typedef struct {
+	int target;
+	double weight;
+} MarkovEdge;
+
+/* Entry of the alias table of a node (Vose's alias method) */
+typedef struct {
+	double probability; // Probability to move to node, otherwise alias is chosen
+	int node;
+	int alias;
+} AliasEntry;
+
 typedef struct {
     char *name;
 	WireValue value[MARKOV_NODE_VALUES][2];
+	Pipeline pipeline[2];
+
+	// Outgoing edges sorted by target, without the loopback edge (100% minus the other weights)
+	MarkovEdge *edges;
+	int edges_count;
+	int edges_size;
+	double loopback;
+	AliasEntry *alias; // edges_count+1 entries, the last one is the loopback edge
+	char modified; // Pending updates (MARKOV_MODIFIED_*), applied by markovCommit
 } MarkovNode;
 
 struct vde_wirefilter_conn;
@@ -52,13 +103,17 @@ void closeMarkov(struct vde_wirefilter_conn *vde_conn);
 
 void markovSetEdges(struct vde_wirefilter_conn *vde_conn, char *edges_str);
 void markovSetNames(struct vde_wirefilter_conn *vde_conn, char *names_str);
+void markovDefer(struct vde_wirefilter_conn *vde_conn, const char defer);
+void markovCommit(struct vde_wirefilter_conn *vde_conn);
 int markovResize(struct vde_wirefilter_conn *vde_conn, const int new_nodes_count);
 void markovStep(struct vde_wirefilter_conn *vde_conn, const int start_node);
+void markovSetTimer(struct vde_wirefilter_conn *vde_conn, const char restart);
 
 void setWireValue(struct vde_wirefilter_conn *vde_conn, const int tag, char *value_str, const int flags);
 double maxWireValue(MarkovNode *node, const int tag, const int direction);
 double minWireValue(MarkovNode *node, const int tag, const int direction);
-double computeWireValue(MarkovNode *node, const int tag, const int direction);
+double computeWireValue(MarkovNode *node, const int tag, const int direction, Random *rng);
+double sampleWireValue(const WireValue *wv, Random *rng);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,291 @@
+#include "./wf_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include "./wf_conn.h"
+#include "./wf_log.h"
+
+// Size of a pool buffer (header + payload), rounded to keep buffers cache line aligned
+#define POOL_PACKET_SIZE ( (sizeof(Packet) + VDE_ETHBUFSIZE + 63) & ~((size_t)63) )
+#define POOL_HEADER_SIZE ( (sizeof(Packet) + 15) & ~((size_t)15) )
+#define POOL_SLAB_HEADER_SIZE 64
+#define SLAB_ITEM(slab, i, size) ( (Packet *)((char *)(slab) + POOL_SLAB_HEADER_SIZE + (i)*(size)) )
+
+struct pool_slab_t {
+	PoolSlab *next;
+};
+
+
+static uint64_t last_pool_id;
+
+// Cache of the calling thread for the last pool it used
+static __thread uint64_t thread_pool_id;
+static __thread PoolCache *thread_cache;
+
+
+int initPool(PacketPool *pool, const unsigned int max_capacity) {
+	handle_error( pthread_mutex_init(&pool->lock, NULL) != 0, { return -1; }, "Pool mutex init error" );
+	pool->id = __atomic_add_fetch(&last_pool_id, 1, __ATOMIC_RELAXED);
+	pool->free_list = NULL;
+	pool->free_count = 0;
+	pool->free_headers = NULL;
+	pool->slabs = NULL;
+	pool->capacity = 0;
+	pool->max_capacity = max_capacity;
+	memset(pool->caches, 0, sizeof(pool->caches));
+	pool->use_caches = (max_capacity == 0 || max_capacity >= POOL_CACHE_SHARE * POOL_CACHES * 2 * POOL_CACHE_BATCH);
+	pool->hits = 0;
+	pool->misses = 0;
+	pool->high_water = 0;
+
+	return 0;
+}
+
+void closePool(PacketPool *pool) {
+	PoolSlab *slab = pool->slabs;
+
+	while (slab != NULL) {
+		PoolSlab *next = slab->next;
+		free(slab);
+		slab = next;
+	}
+
+	pool->slabs = NULL;
+	pool->free_list = NULL;
+	pool->free_headers = NULL;
+	memset(pool->caches, 0, sizeof(pool->caches));
+	pthread_mutex_destroy(&pool->lock);
+}
+
+
+/* Allocates a new slab of items of the given size and adds them to a free list (lock must be held) */
+static int growSlab(PacketPool *pool, Packet **free_list, const size_t item_size, const int items_count) {
+	PoolSlab *slab = aligned_alloc(64, POOL_SLAB_HEADER_SIZE + ((items_count*item_size + 63) & ~((size_t)63)));
+	handle_error( slab == NULL, { return -1; }, "Pool slab malloc error" );
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	for (int i=items_count-1; i>=0; i--) {
+		Packet *packet = SLAB_ITEM(slab, i, item_size);
+		packet->pool = pool;
+		packet->next = *free_list;
+		*free_list = packet;
+	}
+
+	return 0;
+}
+
+static int growPool(PacketPool *pool) {
+	unsigned int count = POOL_SLAB_PACKETS;
+
+	if (pool->max_capacity > 0) {
+		if (pool->capacity >= pool->max_capacity) { return -1; }
+		if (pool->max_capacity - pool->capacity < count) { count = pool->max_capacity - pool->capacity; } // Last slab
+	}
+	handle_error( growSlab(pool, &pool->free_list, POOL_PACKET_SIZE, count) < 0, { return -1; }, NULL );
+	pool->capacity += count;
+	pool->free_count += count;
+
+	return 0;
+}
+
+/* Moves up to count items from a free list to another one, returns the number of moved items */
+static unsigned int moveItems(Packet **from, Packet **to, const unsigned int count) {
+	unsigned int moved = 0;
+
+	while (moved < count && *from != NULL) {
+		Packet *item = *from;
+		*from = item->next;
+		item->next = *to;
+		*to = item;
+		moved++;
+	}
+	return moved;
+}
+
+/**
+ * Returns the cache of the calling thread for the pool, a free cache is taken at the first use.
+ * Returns NULL if the thread has no cache (the pool is small or all the caches are taken).
+*/
+static PoolCache *threadCache(PacketPool *pool) {
+	if (__builtin_expect(thread_pool_id == pool->id, 1)) { return thread_cache; }
+	if (!pool->use_caches) { return NULL; }
+
+	pthread_t self = pthread_self();
+	PoolCache *cache = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	for (int i=0; i<POOL_CACHES && cache == NULL; i++) {
+		if (pool->caches[i].used && pthread_equal(pool->caches[i].owner, self)) { cache = &pool->caches[i]; }
+	}
+	for (int i=0; i<POOL_CACHES && cache == NULL; i++) {
+		if (!pool->caches[i].used) {
+			cache = &pool->caches[i];
+			cache->used = 1;
+			cache->owner = self;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	thread_pool_id = pool->id;
+	thread_cache = cache;
+	return cache;
+}
+
+/* Gives the items over two batches back to the shared free lists */
+static void flushCache(PacketPool *pool, PoolCache *cache) {
+	pthread_mutex_lock(&pool->lock);
+	if (cache->buffers_count >= 2*POOL_CACHE_BATCH) {
+		unsigned int moved = moveItems(&cache->buffers, &pool->free_list, POOL_CACHE_BATCH);
+		cache->buffers_count -= moved;
+		pool->free_count += moved;
+	}
+	if (cache->headers_count >= 2*POOL_CACHE_BATCH) {
+		cache->headers_count -= moveItems(&cache->headers, &pool->free_headers, POOL_CACHE_BATCH);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Gets a buffer from the pool (the pool grows if there are no free buffers)
+ * Returns NULL if the pool is exhausted
+*/
+Packet *poolAlloc(PacketPool *pool) {
+	PoolCache *cache = threadCache(pool);
+	Packet *packet = NULL;
+
+	if (cache != NULL && cache->buffers != NULL) {
+		packet = cache->buffers;
+		cache->buffers = packet->next;
+		cache->buffers_count--;
+		cache->hits++;
+	}
+	else {
+		pthread_mutex_lock(&pool->lock);
+
+		if (pool->free_list != NULL) {
+			pool->hits++;
+		}
+		else {
+			pool->misses++;
+			if (growPool(pool) < 0) { goto exit; }
+		}
+
+		packet = pool->free_list;
+		pool->free_list = packet->next;
+		pool->free_count--;
+
+		// The cache takes the next buffers along
+		if (cache != NULL) {
+			unsigned int moved = moveItems(&pool->free_list, &cache->buffers, POOL_CACHE_BATCH);
+			cache->buffers_count += moved;
+			pool->free_count -= moved;
+		}
+		if (pool->capacity - pool->free_count > pool->high_water) { pool->high_water = pool->capacity - pool->free_count; }
+
+		exit:
+			pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (packet != NULL) {
+		packet->buf = packet->data;
+		packet->len = 0;
+		packet->flags = 0;
+		packet->payload = packet;
+		packet->refcount = 1;
+		packet->next = NULL;
+	}
+	return packet;
+}
+
+/**
+ * Gets a packet header that shares the payload of another packet
+ * Returns NULL if the header cannot be allocated
+*/
+Packet *poolClone(Packet *packet) {
+	PacketPool *pool = packet->pool;
+	PoolCache *cache = threadCache(pool);
+	Packet *clone = NULL;
+
+	if (cache != NULL && cache->headers != NULL) {
+		clone = cache->headers;
+		cache->headers = clone->next;
+		cache->headers_count--;
+	}
+	else {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->free_headers == NULL) {
+			if (growSlab(pool, &pool->free_headers, POOL_HEADER_SIZE, POOL_SLAB_HEADERS) < 0) { goto exit; }
+		}
+		clone = pool->free_headers;
+		pool->free_headers = clone->next;
+		if (cache != NULL) { cache->headers_count += moveItems(&pool->free_headers, &cache->headers, POOL_CACHE_BATCH); }
+
+		exit:
+			pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (clone != NULL) {
+		clone->buf = packet->buf;
+		clone->len = packet->len;
+		clone->flags = packet->flags;
+		clone->direction = packet->direction;
+		clone->payload = packet->payload;
+		clone->next = NULL;
+		__atomic_add_fetch(&packet->payload->refcount, 1, __ATOMIC_RELAXED);
+	}
+	return clone;
+}
+
+/* Gives back a packet to its pool, the buffer is released when its payload is not shared anymore */
+void poolRelease(Packet *packet) {
+	PacketPool *pool = packet->pool;
+	Packet *payload = packet->payload;
+	char release_buffer = (__atomic_sub_fetch(&payload->refcount, 1, __ATOMIC_ACQ_REL) == 0);
+	PoolCache *cache = threadCache(pool);
+
+	if (cache != NULL) {
+		if (packet != payload) {
+			packet->next = cache->headers;
+			cache->headers = packet;
+			cache->headers_count++;
+		}
+		if (release_buffer) {
+			payload->next = cache->buffers;
+			cache->buffers = payload;
+			cache->buffers_count++;
+		}
+
+		// Buffers released by a thread are mostly allocated by another one
+		if (cache->buffers_count >= 2*POOL_CACHE_BATCH || cache->headers_count >= 2*POOL_CACHE_BATCH) { flushCache(pool, cache); }
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (packet != payload) {
+		packet->next = pool->free_headers;
+		pool->free_headers = packet;
+	}
+	if (release_buffer) {
+		payload->next = pool->free_list;
+		pool->free_list = payload;
+		pool->free_count++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* Number of buffers in use (lock must be held), the caches of the other threads are read while they change */
+unsigned int poolInUse(PacketPool *pool) {
+	unsigned int free_count = pool->free_count;
+
+	for (int i=0; i<POOL_CACHES; i++) { free_count += __atomic_load_n(&pool->caches[i].buffers_count, __ATOMIC_RELAXED); }
+	return (free_count < pool->capacity) ? pool->capacity - free_count : 0;
+}
+
+/* Number of allocations served by a free buffer (lock must be held) */
+uint64_t poolHits(PacketPool *pool) {
+	uint64_t hits = pool->hits;
+
+	for (int i=0; i<POOL_CACHES; i++) { hits += __atomic_load_n(&pool->caches[i].hits, __ATOMIC_RELAXED); }
+	return hits;
+}
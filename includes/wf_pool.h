@@ -0,0 +1,74 @@
+#ifndef INCLUDE_POOL
+#define INCLUDE_POOL
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define POOL_SLAB_PACKETS 64 // Number of buffers allocated each time the pool grows
+#define POOL_SLAB_HEADERS 256 // Number of shared payload headers allocated each time the pool grows
+#define POOL_CACHES 8 // Threads with their own free lists, the others use the shared ones
+#define POOL_CACHE_BATCH 32 // Items moved at once between a thread cache and the shared free lists
+#define POOL_CACHE_SHARE 8 // A bounded pool is cached only if the caches can hold at most 1/8 of its buffers
+
+struct packet_t;
+typedef struct packet_t Packet;
+
+struct pool_slab_t;
+typedef struct pool_slab_t PoolSlab;
+
+
+/**
+ * Free lists of a thread, used without locking.
+ * They are refilled from (and flushed to) the shared free lists a batch at a time.
+*/
+typedef struct {
+	pthread_t owner;
+	char used;
+	Packet *buffers;
+	unsigned int buffers_count;
+	Packet *headers;
+	unsigned int headers_count;
+	uint64_t hits; // Allocations served by the cache
+} __attribute__((aligned(64))) PoolCache;
+
+/**
+ * Pool of fixed size (VDE_ETHBUFSIZE) packet buffers, the Packet header is stored inline with its payload.
+ * Payloads are reference counted and can be shared by multiple headers.
+ * The shared free lists are protected by the lock, each thread using the pool gets its own cache
+ * (up to POOL_CACHES threads), so that the lock is taken once for each batch.
+ * A cache holds less than two batches and is drained only by its thread, the buffers in the cache
+ * of an idle thread are not available to the others.
+*/
+struct packet_pool_t {
+	pthread_mutex_t lock;
+	uint64_t id; // Unique in the process, a pool at the address of a closed one is told apart by the threads
+	Packet *free_list;
+	unsigned int free_count;
+	Packet *free_headers;
+	PoolSlab *slabs;
+
+	unsigned int capacity; // Total number of buffers owned by the pool
+	unsigned int max_capacity; // 0 if unlimited
+
+	PoolCache caches[POOL_CACHES];
+	char use_caches; // Buffers stranded in the caches are a small share of a bounded pool
+
+	// Statistics
+	uint64_t hits; // Allocations served by a free buffer of the shared list
+	uint64_t misses; // Allocations that required the pool to grow
+	unsigned int high_water; // Maximum number of buffers out of the shared free list at the same time
+};
+typedef struct packet_pool_t PacketPool;
+
+
+int initPool(PacketPool *pool, const unsigned int max_capacity);
+void closePool(PacketPool *pool);
+
+Packet *poolAlloc(PacketPool *pool);
+Packet *poolClone(Packet *packet);
+void poolRelease(Packet *packet);
+
+unsigned int poolInUse(PacketPool *pool);
+uint64_t poolHits(PacketPool *pool);
+
+#endif
@@ -1,55 +1,185 @@
 #include "./wf_queue.h"
 #include <stdlib.h>
-#include <sys/timerfd.h>
 #include <unistd.h>
 #include "./wf_conn.h"
 #include "./wf_time.h"
 #include "./wf_log.h"
 
-#define QUEUE_CHUNK 100
+#define HEAP_INITIAL_SIZE 256
 
 
-int initQueue(struct vde_wirefilter_conn *vde_conn, const char fifoness) {
+typedef struct {
+	QueueNode *queue; // Priority queue implemented as heap, queue[0] is a sentinel
+	unsigned int size;
+	unsigned int max_size;
+} HeapQueue;
+
+
+static const QueueEngine *selectEngine(struct vde_wirefilter_conn *vde_conn, const char fifoness) {
+	// Packets of a FIFO queue are sorted by construction
+	if (fifoness == FIFO) { return &fifo_queue_engine; }
+	return (vde_conn->queue.engine == QUEUE_WHEEL) ? &wheel_queue_engine : &heap_queue_engine;
+}
+
+int initQueue(struct vde_wirefilter_conn *vde_conn, const char fifoness, const char engine, const uint64_t tick_ns) {
 	vde_conn->queue.fifoness = fifoness;
-	vde_conn->queue.timerfd = timerfd_create(CLOCK_REALTIME, 0);
-	handle_error(vde_conn->queue.timerfd < 0, { return -1; }, "Queue timer fd init error: %s", strerror(errno));
-	vde_conn->queue.queue = NULL;
-	vde_conn->queue.size = 0;
-	vde_conn->queue.max_size = 0;
-	vde_conn->queue.byte_size[LEFT_TO_RIGHT] = 0;
-	vde_conn->queue.byte_size[RIGHT_TO_LEFT] = 0;
-	vde_conn->queue.max_forward_time = 0;
-	vde_conn->queue.counter = 0;
-	
+	vde_conn->queue.engine = engine;
+	vde_conn->queue.tick_ns = tick_ns;
+
+	for (int i=LEFT_TO_RIGHT; i<=RIGHT_TO_LEFT; i++) {
+		DelayQueue *queue = &vde_conn->queue.dir[i];
+		queue->engine = selectEngine(vde_conn, fifoness);
+		queue->data = queue->engine->create(tick_ns);
+		handle_error(queue->data == NULL, { return -1; }, "Queue init error");
+		queue->size = 0;
+		queue->byte_size = 0;
+		queue->max_forward_time = 0;
+		queue->counter = 0;
+		queue->high_water.size = 0;
+		queue->high_water.byte_size = 0;
+		histogramReset(&queue->lateness);
+		queue->timer = (LoopTimer){ 0 };
+	}
+
 	return 0;
 }
 
 void closeQueue(struct vde_wirefilter_conn *vde_conn) {
-	free(vde_conn->queue.queue);
-	close(vde_conn->queue.timerfd);
+	for (int i=LEFT_TO_RIGHT; i<=RIGHT_TO_LEFT; i++) {
+		vde_conn->queue.dir[i].engine->destroy(vde_conn->queue.dir[i].data);
+	}
 }
 
+/**
+ * Changes the fifoness of the queues.
+ * Waiting packets are moved (in order) to the data structure suitable for the new fifoness.
+*/
+int setQueueFifoness(struct vde_wirefilter_conn *vde_conn, const char fifoness) {
+	const QueueEngine *new_engine = selectEngine(vde_conn, fifoness);
+
+	for (int i=LEFT_TO_RIGHT; i<=RIGHT_TO_LEFT; i++) {
+		DelayQueue *queue = &vde_conn->queue.dir[i];
+		if (queue->engine == new_engine) { continue; }
 
-static void resizeQueue(struct vde_wirefilter_conn *vde_conn, const int new_size) {
-	if (vde_conn->queue.queue == NULL) {
-		vde_conn->queue.queue = malloc(new_size * sizeof(QueueNode*));
-		handle_error( vde_conn->queue.queue == NULL, { exit(1); }, "Queue malloc error" );
+		void *new_data = new_engine->create(vde_conn->queue.tick_ns);
+		handle_error(new_data == NULL, { return -1; }, "Queue init error");
 
-		if (new_size > 0) {
-			QueueNode *sentinel = malloc(sizeof(QueueNode));
-			handle_error( sentinel == NULL, { exit(1); }, "Queue sentinel malloc error" );
-			sentinel->packet = NULL;
-			sentinel->forward_time = 0;
-			sentinel->counter = 0;
-			vde_conn->queue.queue[0] = sentinel;
+		for (unsigned int j=0; j<queue->size; j++) {
+			QueueNode node;
+			queue->engine->pop(queue->data, &node);
+			new_engine->push(new_data, &node);
+			if (node.forward_time > queue->max_forward_time) { queue->max_forward_time = node.forward_time; }
 		}
+
+		queue->engine->destroy(queue->data);
+		queue->engine = new_engine;
+		queue->data = new_data;
 	}
-	else {
-		vde_conn->queue.queue = realloc(vde_conn->queue.queue, new_size * sizeof(QueueNode*));
-		handle_error( vde_conn->queue.queue == NULL, { exit(1); }, "Queue realloc error" );
+	vde_conn->queue.fifoness = fifoness;
+
+	return 0;
+}
+
+
+void enqueue(struct vde_wirefilter_conn *vde_conn, Packet *packet, uint64_t forward_time) {
+	DelayQueue *queue = &vde_conn->queue.dir[packet->direction];
+	QueueNode new;
+
+	// Handle ordering for fifoness
+	if (vde_conn->queue.fifoness == FIFO) {
+		if (forward_time > queue->max_forward_time) {
+			// This packet has to be sent later than any of the current packets in the queue
+			// All future packets will be sent after this one (even if they should be sent before)
+			queue->max_forward_time = forward_time;
+			queue->counter = 0;
+		}
+		else {
+			// There is at least a packet that arrived before but has to be sent later than this one
+			// This packet has to wait for the previous one
+			forward_time = queue->max_forward_time;
+			queue->counter++;
+		}
 	}
-	
-	vde_conn->queue.max_size = new_size;
+
+	new.packet = packet;
+	new.forward_time = forward_time;
+	new.counter = queue->counter;
+
+	queue->engine->push(queue->data, &new);
+	queue->size++;
+	queue->byte_size += packet->len;
+	if (queue->size > queue->high_water.size) { queue->high_water.size = queue->size; }
+	if (queue->byte_size > queue->high_water.byte_size) { queue->high_water.byte_size = queue->byte_size; }
+}
+
+Packet *dequeue(struct vde_wirefilter_conn *vde_conn, const int direction) {
+	DelayQueue *queue = &vde_conn->queue.dir[direction];
+	if (queue->size <= 0) { return NULL; }
+	QueueNode out;
+
+	queue->engine->pop(queue->data, &out);
+	queue->size--;
+	queue->byte_size -= out.packet->len;
+
+	return out.packet;
+}
+
+uint64_t nextQueueTime(struct vde_wirefilter_conn *vde_conn, const int direction) {
+	DelayQueue *queue = &vde_conn->queue.dir[direction];
+	return queue->engine->next_time(queue->data);
+}
+
+
+/**
+ * Sets the timer of a direction for its next packet.
+ * The timer expires up to the timer slack after the forward time of the packet, so that the packets due
+ * in that window are released by the same wake up. It is re-armed only if it is not already in the window.
+*/
+void setQueueTimer(struct vde_wirefilter_conn *vde_conn, const int direction) {
+	DelayQueue *queue = &vde_conn->queue.dir[direction];
+	if (queue->size <= 0) { return; }
+
+	uint64_t next_time = nextQueueTime(vde_conn, direction);
+	uint64_t deadline = next_time + vde_conn->queue.timer_slack;
+	if (timerArmed(&queue->timer) && queue->timer.deadline >= next_time && queue->timer.deadline <= deadline) { return; } // Already armed for this packet
+
+	timerSet(&queue->timer, deadline);
+}
+
+
+char queueShouldShrink(const unsigned int size, const unsigned int allocated) {
+	return (size == 0 && allocated > QUEUE_IDLE_SIZE);
+}
+
+
+/*
+	Binary heap engine
+*/
+
+/* Capacity changes keep the sentinel */
+static void resizeQueue(HeapQueue *heap, const unsigned int new_size) {
+	QueueNode *queue = realloc(heap->queue, new_size * sizeof(QueueNode));
+	handle_error( queue == NULL, { exit(1); }, "Queue realloc error" );
+
+	if (heap->queue == NULL) { queue[0] = (QueueNode){ .packet=NULL, .forward_time=0, .counter=0 }; }
+	heap->queue = queue;
+	heap->max_size = new_size;
+}
+
+static void *heapCreate(const uint64_t tick_ns) {
+	(void)tick_ns;
+	HeapQueue *heap = calloc(1, sizeof(HeapQueue));
+	handle_error( heap == NULL, { return NULL; }, "Queue malloc error" );
+	resizeQueue(heap, HEAP_INITIAL_SIZE);
+
+	return heap;
+}
+
+static void heapDestroy(void *data) {
+	HeapQueue *heap = data;
+
+	free(heap->queue);
+	free(heap);
 }
 
 /*
@@ -69,89 +199,65 @@ static int compareNode(const QueueNode *node1, const QueueNode *node2) {
 	}
 }
 
-void enqueue(struct vde_wirefilter_conn *vde_conn, Packet *packet, uint64_t forward_time) {
-	QueueNode *new = malloc(sizeof(QueueNode));
-	handle_error( new == NULL, { exit(1); }, "Queue new node malloc error" );
-
-	// Handle ordering for fifoness
-	if (vde_conn->queue.fifoness == FIFO) {
-		if (forward_time > vde_conn->queue.max_forward_time) {
-			// This packet has to be sent later than any of the current packets in the queue
-			// All future packets will be sent after this one (even if they should be sent before)
-			vde_conn->queue.max_forward_time = forward_time;
-			vde_conn->queue.counter = 0;
-		}
-		else {
-			// There is at least a packet that arrived before but has to be sent later than this one 
-			// This packet has to wait for the previous one
-			forward_time = vde_conn->queue.max_forward_time;
-			vde_conn->queue.counter++;
-		}
-	}
-
-	new->packet = packet;
-	new->forward_time = forward_time;
-	new->counter = vde_conn->queue.counter;
+static void heapPush(void *data, const QueueNode *node) {
+	HeapQueue *heap = data;
 
-	// Queue resize
-	if (vde_conn->queue.size >= vde_conn->queue.max_size) {
-		resizeQueue(vde_conn, vde_conn->queue.max_size + QUEUE_CHUNK);
+	// Geometric growth, so that large backlogs cost a logarithmic number of reallocs
+	if (heap->size+1 >= heap->max_size) {
+		resizeQueue(heap, heap->max_size * 2);
 	}
 
-	vde_conn->queue.size++;
-	vde_conn->queue.byte_size[packet->direction] += packet->len;
+	heap->size++;
 
 	// Adds new node to heap
-	int k = vde_conn->queue.size;
-	while ( compareNode(new, vde_conn->queue.queue[k>>1]) < 0 ) {
-		vde_conn->queue.queue[k] = vde_conn->queue.queue[k>>1];
+	unsigned int k = heap->size;
+	while ( compareNode(node, &heap->queue[k>>1]) < 0 ) {
+		heap->queue[k] = heap->queue[k>>1];
 		k >>= 1;
 	}
-	vde_conn->queue.queue[k] = new;
+	heap->queue[k] = *node;
 }
 
-Packet *dequeue(struct vde_wirefilter_conn *vde_conn) {
-	if (vde_conn->queue.size <= 0) { return NULL; }
-	
-	Packet *out_packet = vde_conn->queue.queue[1]->packet;
+static void heapPop(void *data, QueueNode *node) {
+	HeapQueue *heap = data;
 
 	// Head remove
-	vde_conn->queue.size--;
-	vde_conn->queue.byte_size[out_packet->direction] -= out_packet->len;
-	free(vde_conn->queue.queue[1]);
+	*node = heap->queue[1];
+	heap->size--;
 
 	// Heap rebuild
-	QueueNode *old = vde_conn->queue.queue[vde_conn->queue.size+1];
+	QueueNode old = heap->queue[heap->size+1];
 	unsigned int k = 1;
 
-	while (k <= vde_conn->queue.size/2) {
+	while (k <= heap->size/2) {
 		unsigned int j = k<<1;
 
 		// Selects the min between queue[2k] and queue[2k+1]
-		if ((j < vde_conn->queue.size) && compareNode(vde_conn->queue.queue[j], vde_conn->queue.queue[j+1]) > 0) { j++; }
+		if ((j < heap->size) && compareNode(&heap->queue[j], &heap->queue[j+1]) > 0) { j++; }
 
-		if (compareNode(old, vde_conn->queue.queue[j]) < 0) { 
-			break; 
+		if (compareNode(&old, &heap->queue[j]) < 0) {
+			break;
 		}
 		else {
-			vde_conn->queue.queue[k] = vde_conn->queue.queue[j];
+			heap->queue[k] = heap->queue[j];
 			k = j;
 		}
 	}
-	vde_conn->queue.queue[k] = old;
+	heap->queue[k] = old;
 
-	return out_packet;
+	if (queueShouldShrink(heap->size, heap->max_size)) { resizeQueue(heap, QUEUE_IDLE_SIZE); }
 }
 
-uint64_t nextQueueTime(struct vde_wirefilter_conn *vde_conn) {
-	return vde_conn->queue.queue[1]->forward_time;
+static uint64_t heapNextTime(void *data) {
+	HeapQueue *heap = data;
+	return heap->queue[1].forward_time;
 }
 
-
-/* Sets the timerfd for the next packet to send */
-void setQueueTimer(struct vde_wirefilter_conn *vde_conn) {
-	int64_t next_time_step = nextQueueTime(vde_conn) - now_ns();
-	if (next_time_step <= 0) next_time_step = 1;
-
-	setTimer(vde_conn->queue.timerfd, next_time_step);
-}
\ No newline at end of file
+const QueueEngine heap_queue_engine = {
+	.name = "heap",
+	.create = heapCreate,
+	.destroy = heapDestroy,
+	.push = heapPush,
+	.pop = heapPop,
+	.next_time = heapNextTime
+};
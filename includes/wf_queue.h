@@ -2,6 +2,14 @@
 #define INCLUDE_QUEUE
 
 #include <stdint.h>
+#include "./wf_histogram.h"
+#include "./wf_loop.h"
+
+#define QUEUE_HEAP	0
+#define QUEUE_WHEEL	1
+
+#define WHEEL_DEFAULT_TICK_NS 10000 // Default granularity of the timing wheel
+#define QUEUE_IDLE_SIZE 1024 // Nodes kept allocated by an empty queue (see queueShouldShrink)
 
 struct vde_wirefilter_conn;
 struct packet_t;
@@ -16,13 +24,68 @@ struct queuenode_t {
 typedef struct queuenode_t QueueNode;
 
 
-int initQueue(struct vde_wirefilter_conn *vde_conn, const char fifoness);
+/* Data structure that keeps the delayed packets ordered by forward time */
+struct queue_engine_t {
+	const char *name;
+	void *(*create)(const uint64_t tick_ns);
+	void (*destroy)(void *data);
+	void (*push)(void *data, const QueueNode *node);
+	void (*pop)(void *data, QueueNode *node); // Removes the first node (the queue must not be empty)
+	uint64_t (*next_time)(void *data); // Forward time of the first node (the queue must not be empty)
+};
+typedef struct queue_engine_t QueueEngine;
+
+extern const QueueEngine heap_queue_engine;
+extern const QueueEngine wheel_queue_engine;
+extern const QueueEngine fifo_queue_engine;
+
+/**
+ * Shrink on idle policy of the engines, checked after each pop.
+ * The memory of a past backlog is released once the queue is empty, QUEUE_IDLE_SIZE nodes are kept
+ * so that a steady flow of packets does not reallocate. Returns 1 if the engine, holding size nodes
+ * out of allocated, should shrink to QUEUE_IDLE_SIZE nodes.
+*/
+char queueShouldShrink(const unsigned int size, const unsigned int allocated);
+
+
+/* Delay queue of a single direction */
+struct delay_queue_t {
+	const QueueEngine *engine;
+	void *data;
+	unsigned int size;
+	unsigned int byte_size;
+	LoopTimer timer; // Release of the delayed packets, served by the loop handling the direction
+
+	// Delay between the timer deadline and the actual wake up
+	struct {
+		uint64_t samples;
+		uint64_t total_ns;
+		uint64_t max_ns;
+	} overshoot;
+
+	Histogram lateness; // Delay (in ns) between the forward time of the packets and their actual release
+
+	// Maximum size reached since the last stats reset
+	struct {
+		unsigned int size;
+		unsigned int byte_size;
+	} high_water;
+
+	// To preserve fifoness
+	uint64_t max_forward_time;
+	unsigned int counter;
+};
+typedef struct delay_queue_t DelayQueue;
+
+
+int initQueue(struct vde_wirefilter_conn *vde_conn, const char fifoness, const char engine, const uint64_t tick_ns);
 void closeQueue(struct vde_wirefilter_conn *vde_conn);
+int setQueueFifoness(struct vde_wirefilter_conn *vde_conn, const char fifoness);
 
 void enqueue(struct vde_wirefilter_conn *vde_conn, Packet *packet, uint64_t forward_time);
-Packet *dequeue(struct vde_wirefilter_conn *vde_conn);
-uint64_t nextQueueTime(struct vde_wirefilter_conn *vde_conn);
+Packet *dequeue(struct vde_wirefilter_conn *vde_conn, const int direction);
+uint64_t nextQueueTime(struct vde_wirefilter_conn *vde_conn, const int direction);
 
-void setQueueTimer(struct vde_wirefilter_conn *vde_conn);
+void setQueueTimer(struct vde_wirefilter_conn *vde_conn, const int direction);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,96 @@
+#include "./wf_queue.h"
+#include <stdlib.h>
+#include <string.h>
+#include "./wf_log.h"
+
+/*
+	FIFO engine
+	When fifoness is preserved the forward times are non-decreasing by construction,
+	so the packets can be kept in a growable ring buffer.
+*/
+
+#define FIFO_INITIAL_SIZE 256
+
+
+typedef struct {
+	QueueNode *nodes;
+	unsigned int mask; // Capacity - 1 (capacity is a power of 2)
+	unsigned int head;
+	unsigned int tail;
+} FifoQueue;
+
+
+static void *fifoCreate(const uint64_t tick_ns) {
+	(void)tick_ns;
+	FifoQueue *fifo = calloc(1, sizeof(FifoQueue));
+	handle_error( fifo == NULL, { return NULL; }, "FIFO queue malloc error" );
+
+	fifo->nodes = malloc(FIFO_INITIAL_SIZE * sizeof(QueueNode));
+	handle_error( fifo->nodes == NULL, { free(fifo); return NULL; }, "FIFO queue malloc error" );
+	fifo->mask = FIFO_INITIAL_SIZE - 1;
+
+	return fifo;
+}
+
+static void fifoDestroy(void *data) {
+	FifoQueue *fifo = data;
+
+	free(fifo->nodes);
+	free(fifo);
+}
+
+/* Doubles the capacity of the ring keeping the nodes contiguous */
+static void fifoGrow(FifoQueue *fifo) {
+	unsigned int capacity = fifo->mask + 1;
+	unsigned int head_index = fifo->head & fifo->mask;
+
+	QueueNode *nodes = malloc(2 * capacity * sizeof(QueueNode));
+	handle_error( nodes == NULL, { exit(1); }, "FIFO queue realloc error" );
+	memcpy(nodes, &fifo->nodes[head_index], (capacity - head_index) * sizeof(QueueNode));
+	memcpy(&nodes[capacity - head_index], fifo->nodes, head_index * sizeof(QueueNode));
+
+	free(fifo->nodes);
+	fifo->nodes = nodes;
+	fifo->mask = 2*capacity - 1;
+	fifo->head = 0;
+	fifo->tail = capacity;
+}
+
+static void fifoPush(void *data, const QueueNode *node) {
+	FifoQueue *fifo = data;
+
+	if (fifo->tail - fifo->head > fifo->mask) { fifoGrow(fifo); }
+
+	fifo->nodes[fifo->tail & fifo->mask] = *node;
+	fifo->tail++;
+}
+
+static void fifoPop(void *data, QueueNode *node) {
+	FifoQueue *fifo = data;
+
+	*node = fifo->nodes[fifo->head & fifo->mask];
+	fifo->head++;
+
+	if (queueShouldShrink(fifo->tail - fifo->head, fifo->mask + 1)) {
+		QueueNode *nodes = realloc(fifo->nodes, QUEUE_IDLE_SIZE * sizeof(QueueNode));
+		if (nodes == NULL) { return; } // The larger ring is still usable
+		fifo->nodes = nodes;
+		fifo->mask = QUEUE_IDLE_SIZE - 1;
+		fifo->head = 0;
+		fifo->tail = 0;
+	}
+}
+
+static uint64_t fifoNextTime(void *data) {
+	FifoQueue *fifo = data;
+	return fifo->nodes[fifo->head & fifo->mask].forward_time;
+}
+
+const QueueEngine fifo_queue_engine = {
+	.name = "fifo",
+	.create = fifoCreate,
+	.destroy = fifoDestroy,
+	.push = fifoPush,
+	.pop = fifoPop,
+	.next_time = fifoNextTime
+};
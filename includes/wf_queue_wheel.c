@@ -0,0 +1,288 @@
+#include "./wf_queue.h"
+#include <stdlib.h>
+#include "./wf_time.h"
+#include "./wf_log.h"
+
+/*
+	Hierarchical timing wheel engine
+	Level 0 has a slot for each tick, each slot of level k covers 256^k ticks.
+	A node is placed on the level of the most significant byte in which its tick differs from the
+	wheel cursor, so the first occupied slot of the lowest non-empty level always holds the next node.
+	A level 0 slot (a single tick) is sorted by forward time before its nodes are released,
+	nodes with the same time are kept in insertion order.
+*/
+
+#define WHEEL_LEVELS	4
+#define WHEEL_BITS		8
+#define WHEEL_SLOTS		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SLOTS - 1)
+#define WHEEL_WORDS		(WHEEL_SLOTS / 64)
+#define WHEEL_CHUNK		QUEUE_IDLE_SIZE // Nodes allocated each time the wheel grows
+
+
+typedef struct wheel_node_t {
+	QueueNode node;
+	struct wheel_node_t *next;
+} WheelNode;
+
+typedef struct {
+	WheelNode *head;
+	WheelNode *tail;
+	uint64_t min_time; // Minimum forward time of the slot nodes
+	char sorted; // Nodes are in forward time order
+} WheelSlot;
+
+typedef struct wheel_chunk_t {
+	struct wheel_chunk_t *next;
+	WheelNode nodes[WHEEL_CHUNK];
+} WheelChunk;
+
+typedef struct {
+	uint64_t tick_ns;
+	uint64_t cursor; // Tick of the last released node, never ahead of the present
+	unsigned int size;
+
+	WheelSlot slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t occupied[WHEEL_LEVELS][WHEEL_WORDS]; // Bitmap of the non-empty slots
+	WheelSlot overflow; // Nodes too far in the future for the wheel
+
+	WheelNode *free_nodes;
+	WheelChunk *chunks;
+	unsigned int capacity; // Nodes allocated in the chunks
+} TimingWheel;
+
+
+static void *wheelCreate(const uint64_t tick_ns) {
+	TimingWheel *wheel = calloc(1, sizeof(TimingWheel));
+	handle_error( wheel == NULL, { return NULL; }, "Timing wheel malloc error" );
+	wheel->tick_ns = (tick_ns > 0) ? tick_ns : WHEEL_DEFAULT_TICK_NS;
+	wheel->cursor = now_ns() / wheel->tick_ns;
+
+	return wheel;
+}
+
+static void wheelDestroy(void *data) {
+	TimingWheel *wheel = data;
+	WheelChunk *chunk = wheel->chunks;
+
+	while (chunk != NULL) {
+		WheelChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(wheel);
+}
+
+
+static void freeChunkNodes(TimingWheel *wheel, WheelChunk *chunk) {
+	for (int i=WHEEL_CHUNK-1; i>=0; i--) {
+		chunk->nodes[i].next = wheel->free_nodes;
+		wheel->free_nodes = &chunk->nodes[i];
+	}
+}
+
+static WheelNode *allocNode(TimingWheel *wheel) {
+	if (wheel->free_nodes == NULL) {
+		WheelChunk *chunk = malloc(sizeof(WheelChunk));
+		handle_error( chunk == NULL, { exit(1); }, "Timing wheel node malloc error" );
+		chunk->next = wheel->chunks;
+		wheel->chunks = chunk;
+		wheel->capacity += WHEEL_CHUNK;
+		freeChunkNodes(wheel, chunk);
+	}
+
+	WheelNode *node = wheel->free_nodes;
+	wheel->free_nodes = node->next;
+	return node;
+}
+
+static void slotAppend(WheelSlot *slot, WheelNode *node) {
+	node->next = NULL;
+
+	if (slot->head == NULL) {
+		slot->head = node;
+		slot->min_time = node->node.forward_time;
+		slot->sorted = 1;
+	}
+	else {
+		if (node->node.forward_time < slot->tail->node.forward_time) { slot->sorted = 0; }
+		slot->tail->next = node;
+		if (node->node.forward_time < slot->min_time) { slot->min_time = node->node.forward_time; }
+	}
+	slot->tail = node;
+}
+
+/* Sorts the nodes of a slot by forward time, equal times keep their order (bottom-up merge sort) */
+static void slotSort(WheelSlot *slot) {
+	WheelNode *list = slot->head;
+	WheelNode *last = NULL;
+	unsigned int merges;
+
+	for (unsigned int width=1; ; width<<=1) {
+		WheelNode *head = NULL, **tail = &head;
+		WheelNode *p = list;
+		merges = 0;
+
+		// Merges each couple of adjacent runs of width nodes
+		while (p != NULL) {
+			WheelNode *q = p;
+			unsigned int p_size = 0, q_size = width;
+			merges++;
+
+			while (p_size < width && q != NULL) { p_size++; q = q->next; }
+
+			while (p_size > 0 || (q_size > 0 && q != NULL)) {
+				WheelNode *next;
+				if (p_size > 0 && (q_size == 0 || q == NULL || p->node.forward_time <= q->node.forward_time)) {
+					next = p; p = p->next; p_size--;
+				}
+				else {
+					next = q; q = q->next; q_size--;
+				}
+				*tail = last = next;
+				tail = &next->next;
+			}
+			p = q;
+		}
+		*tail = NULL;
+		list = head;
+
+		if (merges <= 1) { break; }
+	}
+
+	slot->head = list;
+	slot->tail = last;
+	slot->sorted = 1;
+}
+
+/* Places a node in the wheel according to the current cursor */
+static void wheelInsert(TimingWheel *wheel, WheelNode *node) {
+	uint64_t tick = node->node.forward_time / wheel->tick_ns;
+	if (tick < wheel->cursor) { tick = wheel->cursor; }
+
+	uint64_t diff = tick ^ wheel->cursor;
+	int level = (diff == 0) ? 0 : (63 - __builtin_clzll(diff)) / WHEEL_BITS;
+
+	if (level >= WHEEL_LEVELS) {
+		slotAppend(&wheel->overflow, node);
+		return;
+	}
+
+	int index = (tick >> (level*WHEEL_BITS)) & WHEEL_MASK;
+	slotAppend(&wheel->slots[level][index], node);
+	wheel->occupied[level][index >> 6] |= (1ULL << (index & 63));
+}
+
+/* Returns the index of the first non-empty slot of a level starting from a given index, -1 if none */
+static int firstOccupied(TimingWheel *wheel, const int level, const int from) {
+	int word = from >> 6;
+	uint64_t bits = wheel->occupied[level][word] & (~0ULL << (from & 63));
+
+	while (1) {
+		if (bits != 0) { return (word << 6) + __builtin_ctzll(bits); }
+		if (++word >= WHEEL_WORDS) { return -1; }
+		bits = wheel->occupied[level][word];
+	}
+}
+
+/* Finds the slot that contains the next node, returns its level (WHEEL_LEVELS for the overflow list) */
+static int nextSlot(TimingWheel *wheel, int *index) {
+	for (int level=0; level<WHEEL_LEVELS; level++) {
+		*index = firstOccupied(wheel, level, (wheel->cursor >> (level*WHEEL_BITS)) & WHEEL_MASK);
+		if (*index >= 0) { return level; }
+	}
+	return WHEEL_LEVELS;
+}
+
+/* Moves the nodes of a slot to the lower levels, the cursor is moved to the beginning of the slot */
+static void cascade(TimingWheel *wheel, const int level, const int index) {
+	WheelSlot *slot = (level < WHEEL_LEVELS) ? &wheel->slots[level][index] : &wheel->overflow;
+	WheelNode *node = slot->head;
+
+	if (level < WHEEL_LEVELS) {
+		uint64_t span_mask = (1ULL << ((level+1)*WHEEL_BITS)) - 1;
+		wheel->cursor = (wheel->cursor & ~span_mask) | ((uint64_t)index << (level*WHEEL_BITS));
+		wheel->occupied[level][index >> 6] &= ~(1ULL << (index & 63));
+	}
+	else {
+		wheel->cursor = slot->min_time / wheel->tick_ns;
+	}
+	slot->head = slot->tail = NULL;
+
+	while (node != NULL) {
+		WheelNode *next = node->next;
+		wheelInsert(wheel, node);
+		node = next;
+	}
+}
+
+
+static void wheelPush(void *data, const QueueNode *node) {
+	TimingWheel *wheel = data;
+	WheelNode *new = allocNode(wheel);
+	new->node = *node;
+
+	wheelInsert(wheel, new);
+	wheel->size++;
+}
+
+static void wheelPop(void *data, QueueNode *node) {
+	TimingWheel *wheel = data;
+	int level, index;
+
+	// The next node is due, so the cursor can be moved up to its slot
+	while ((level = nextSlot(wheel, &index)) > 0) {
+		cascade(wheel, level, index);
+	}
+
+	// Nodes of the same tick may have been inserted out of order
+	WheelSlot *slot = &wheel->slots[0][index];
+	if (!slot->sorted) { slotSort(slot); }
+	WheelNode *head = slot->head;
+	*node = head->node;
+
+	wheel->cursor = (wheel->cursor & ~(uint64_t)WHEEL_MASK) | index;
+	slot->head = head->next;
+	if (slot->head == NULL) {
+		slot->tail = NULL;
+		wheel->occupied[0][index >> 6] &= ~(1ULL << (index & 63));
+	}
+	else {
+		slot->min_time = slot->head->node.forward_time; // The slot is sorted
+	}
+
+	head->next = wheel->free_nodes;
+	wheel->free_nodes = head;
+	wheel->size--;
+
+	// A single chunk (QUEUE_IDLE_SIZE nodes) is kept
+	if (queueShouldShrink(wheel->size, wheel->capacity)) {
+		WheelChunk *chunk = wheel->chunks->next;
+		while (chunk != NULL) {
+			WheelChunk *next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+		wheel->chunks->next = NULL;
+		wheel->capacity = WHEEL_CHUNK;
+		wheel->free_nodes = NULL;
+		freeChunkNodes(wheel, wheel->chunks);
+	}
+}
+
+static uint64_t wheelNextTime(void *data) {
+	TimingWheel *wheel = data;
+	int index;
+	int level = nextSlot(wheel, &index);
+
+	return (level < WHEEL_LEVELS) ? wheel->slots[level][index].min_time : wheel->overflow.min_time;
+}
+
+const QueueEngine wheel_queue_engine = {
+	.name = "wheel",
+	.create = wheelCreate,
+	.destroy = wheelDestroy,
+	.push = wheelPush,
+	.pop = wheelPop,
+	.next_time = wheelNextTime
+};
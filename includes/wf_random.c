@@ -0,0 +1,275 @@
+#include "./wf_random.h"
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <math.h>
+#include <pthread.h>
+#include "./wf_conn.h"
+#include "./wf_markov.h"
+
+
+/**
+ * Initializes the random streams of a connection.
+ * Each impairment of each direction (and the Markov chain) has its own stream, so that the
+ * sequence of a stream does not depend on how the other streams are used.
+*/
+void initRandom(struct vde_wirefilter_conn *vde_conn, const uint64_t seed) {
+	unsigned int stream = 0;
+
+	vde_conn->random.seed = seed;
+	for (int tag=0; tag<MARKOV_NODE_VALUES; tag++) {
+		randomInit(&vde_conn->random.streams[tag][LEFT_TO_RIGHT], seed, stream++);
+		randomInit(&vde_conn->random.streams[tag][RIGHT_TO_LEFT], seed, stream++);
+	}
+	randomInit(&vde_conn->random.markov, seed, stream++);
+}
+
+/* Returns a seed for runs that do not need to be reproduced */
+uint64_t randomSeed() {
+	uint64_t seed;
+
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		seed = ((uint64_t)t.tv_sec << 32) ^ t.tv_nsec ^ getpid();
+	}
+
+	return seed;
+}
+
+
+static inline uint64_t rotl(const uint64_t x, const int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix64(uint64_t *x) {
+	uint64_t z = (*x += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+/* Advances the generator by 2^128 steps (non-overlapping subsequences) */
+static void randomJump(Random *rng) {
+	static const uint64_t JUMP[] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+	uint64_t s[4] = { 0, 0, 0, 0 };
+
+	for (int i=0; i<4; i++) {
+		for (int b=0; b<64; b++) {
+			if (JUMP[i] & (1ULL << b)) {
+				for (int j=0; j<4; j++) { s[j] ^= rng->state[j]; }
+			}
+			randomNext(rng);
+		}
+	}
+
+	for (int j=0; j<4; j++) { rng->state[j] = s[j]; }
+}
+
+/* Initializes the given stream of the sequence identified by the seed */
+void randomInit(Random *rng, const uint64_t seed, const unsigned int stream) {
+	uint64_t x = seed;
+
+	for (int i=0; i<4; i++) { rng->state[i] = splitmix64(&x); }
+	for (unsigned int i=0; i<stream; i++) { randomJump(rng); }
+	rng->next = RANDOM_BATCH; // The batches are generated at first use
+	rng->next_normal = RANDOM_BATCH;
+	rng->binomial.n = 0; // No constants computed yet
+}
+
+
+uint64_t randomNext(Random *rng) {
+	uint64_t *s = rng->state;
+	const uint64_t result = rotl(s[1] * 5, 7) * 9;
+	const uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+
+	return result;
+}
+
+/* Fills a buffer with uniform numbers in [0, 1) */
+void randomFill(Random *rng, double *out, const unsigned int count) {
+	for (unsigned int i=0; i<count; i++) {
+		out[i] = (randomNext(rng) >> 11) * 0x1.0p-53;
+	}
+}
+
+
+/*
+	Ziggurat method for standard normals (Marsaglia and Tsang, with Doornik's layout):
+	the density is covered by ZIGGURAT_LAYERS layers of equal area, most numbers are
+	accepted inside a rectangle with a single 64-bit output and a multiplication.
+*/
+#define ZIGGURAT_LAYERS 128
+#define ZIGGURAT_R 3.442619855899 // Start of the tail
+#define ZIGGURAT_V 9.91256303526217e-3 // Area of each layer
+
+static double ziggurat_x[ZIGGURAT_LAYERS + 1]; // Right edges of the layers
+static double ziggurat_ratio[ZIGGURAT_LAYERS]; // Part of each layer fully under the density
+static pthread_once_t ziggurat_once = PTHREAD_ONCE_INIT;
+
+static void initZiggurat() {
+	double f = exp(-0.5 * ZIGGURAT_R * ZIGGURAT_R);
+
+	ziggurat_x[0] = ZIGGURAT_V / f; // Base layer, its rectangle includes the tail
+	ziggurat_x[1] = ZIGGURAT_R;
+	ziggurat_x[ZIGGURAT_LAYERS] = 0;
+
+	for (int i=2; i<ZIGGURAT_LAYERS; i++) {
+		ziggurat_x[i] = sqrt(-2 * log(ZIGGURAT_V / ziggurat_x[i-1] + f));
+		f = exp(-0.5 * ziggurat_x[i] * ziggurat_x[i]);
+	}
+
+	for (int i=0; i<ZIGGURAT_LAYERS; i++) {
+		ziggurat_ratio[i] = ziggurat_x[i+1] / ziggurat_x[i];
+	}
+}
+
+/* Draws from the tail beyond ZIGGURAT_R (Marsaglia) */
+static double zigguratTail(Random *rng, const char negative) {
+	double x, y;
+
+	do {
+		x = log1p(-randomUniform(rng)) / ZIGGURAT_R;
+		y = log1p(-randomUniform(rng));
+	} while (-2 * y < x * x);
+
+	return negative ? x - ZIGGURAT_R : ZIGGURAT_R - x;
+}
+
+static double zigguratNormal(Random *rng) {
+	for (;;) {
+		uint64_t r = randomNext(rng);
+		double u = (r >> 11) * 0x1.0p-52 - 1.0; // Uniform in [-1, 1)
+		int i = r & (ZIGGURAT_LAYERS - 1); // The low bits are not used by u
+
+		if (fabs(u) < ziggurat_ratio[i]) { return u * ziggurat_x[i]; }
+		if (i == 0) { return zigguratTail(rng, u < 0); }
+
+		// Between the rectangle and the density
+		double x = u * ziggurat_x[i];
+		double f0 = exp(-0.5 * (ziggurat_x[i] * ziggurat_x[i] - x * x));
+		double f1 = exp(-0.5 * (ziggurat_x[i+1] * ziggurat_x[i+1] - x * x));
+		if (f1 + randomUniform(rng) * (f0 - f1) < 1.0) { return x; }
+	}
+}
+
+/* Fills a buffer with standard normal numbers */
+void randomNormalFill(Random *rng, double *out, const unsigned int count) {
+	pthread_once(&ziggurat_once, initZiggurat);
+
+	for (unsigned int i=0; i<count; i++) {
+		out[i] = zigguratNormal(rng);
+	}
+}
+
+/**
+ * Binomial draw by inversion, given the uniform u > 1 - mean (otherwise the draw is 0).
+ * Walks up the probabilities from P(0), expected mean+1 steps.
+*/
+unsigned int binomialInversion(Random *rng, const unsigned int n, const double p, double u) {
+	if (n != rng->binomial.n || p != rng->binomial.p) {
+		rng->binomial.n = n;
+		rng->binomial.p = p;
+		rng->binomial.p0 = exp(n * log1p(-p));
+	}
+
+	double s = p / (1 - p);
+	double a = (n + 1) * s;
+	double r = rng->binomial.p0;
+	unsigned int x = 0;
+
+	while (u > r && x < n) {
+		u -= r;
+		x++;
+		r *= (a / x) - s; // P(x) from P(x-1)
+	}
+	return x;
+}
+
+/*
+	BTRS, transformed rejection with squeeze (Hörmann, "The generation of binomial random variates", 1993),
+	exact for means of at least 10 and drawing about 2.3 uniforms on average whatever the mean.
+*/
+static unsigned int binomialBtrs(Random *rng, const unsigned int n, const double p) {
+	BinomialConstants *k = &rng->binomial;
+
+	if (n != k->n || p != k->p) {
+		double spq = sqrt(n * p * (1 - p));
+
+		k->n = n;
+		k->p = p;
+		k->p0 = exp(n * log1p(-p));
+		k->b = 1.15 + 2.53 * spq;
+		k->a = -0.0873 + 0.0248 * k->b + 0.01 * p;
+		k->c = n * p + 0.5;
+		k->v_r = 0.92 - 4.2 / k->b;
+		k->alpha = (2.83 + 5.1 / k->b) * spq;
+		k->lpq = log(p / (1 - p));
+		k->m = floor((n + 1) * p); // Mode
+		k->h = lgamma(k->m + 1) + lgamma(n - k->m + 1);
+	}
+
+	for (;;) {
+		double u = randomUniform(rng) - 0.5;
+		double v = randomUniform(rng);
+		double us = 0.5 - fabs(u);
+		double x = floor((2 * k->a / us + k->b) * u + k->c);
+
+		if (x < 0 || x > n) { continue; }
+		if (us >= 0.07 && v <= k->v_r) { return (unsigned int)x; } // Squeeze, most draws end here
+
+		v = log(v * k->alpha / (k->a / (us * us) + k->b));
+		if (v <= k->h - lgamma(x + 1) - lgamma(n - x + 1) + (x - k->m) * k->lpq) { return (unsigned int)x; }
+	}
+}
+
+/**
+ * Number of successes of n trials with probability p.
+ * Small means are drawn by inversion, large means by BTRS, both exact.
+*/
+unsigned int randomBinomialDraw(Random *rng, const unsigned int n, const double p) {
+	if (p <= 0 || n == 0) { return 0; }
+	if (p >= 1) { return n; }
+	if (p > 0.5) { return n - randomBinomialDraw(rng, n, 1 - p); }
+
+	double mean = n * p;
+
+	if (mean < BINOMIAL_INVERSION_MAX) {
+		double u = randomUniform(rng);
+		return (u <= 1 - mean) ? 0 : binomialInversion(rng, n, p, u);
+	}
+
+	return binomialBtrs(rng, n, p);
+}
+
+/**
+ * Number of successes before the first failure, with success probability p, up to max.
+ * Drawn by inversion with a single uniform (the logarithm is needed only if there is a success).
+*/
+unsigned int randomGeometric(Random *rng, const double p, const unsigned int max) {
+	if (p <= 0) { return 0; }
+	if (p >= 1) { return max; }
+
+	double u = randomUniform(rng);
+	if (u < 1 - p) { return 0; }
+
+	double k = floor(log1p(-u) / log(p));
+	return (k < max) ? (unsigned int)k : max;
+}
+
+/* Fills a buffer with uniform indexes in [0, n), two for each generated number */
+void randomIndexes(Random *rng, uint32_t *out, const unsigned int count, const uint32_t n) {
+	for (unsigned int i=0; i<count; i+=2) {
+		uint64_t r = randomNext(rng);
+
+		out[i] = ((r >> 32) * n) >> 32;
+		if (i+1 < count) { out[i+1] = ((r & 0xffffffff) * n) >> 32; }
+	}
+}
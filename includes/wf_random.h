@@ -0,0 +1,80 @@
+#ifndef INCLUDE_RANDOM
+#define INCLUDE_RANDOM
+
+#include <stdint.h>
+
+#define RANDOM_BATCH 64 // Uniforms (and normals) generated at each refill
+#define BINOMIAL_INVERSION_MAX 16 // Largest binomial mean drawn by inversion (BTRS above)
+
+struct vde_wirefilter_conn;
+
+
+/* Constants of the binomial draws with parameters n and p */
+struct binomial_constants_t {
+	unsigned int n;
+	double p;
+	double p0; // Inversion
+	double a, b, c, v_r, alpha, lpq, m, h; // BTRS
+};
+typedef struct binomial_constants_t BinomialConstants;
+
+/**
+ * xoshiro256** generator.
+ * Uniforms and standard normals are generated in batches and consumed from buffers.
+*/
+struct random_t {
+	uint64_t state[4];
+	unsigned int next; // Next uniform of the batch to use
+	unsigned int next_normal; // Next normal of the normal batch to use
+	BinomialConstants binomial; // Of the last binomial parameters, packets of the same length share them
+	double batch[RANDOM_BATCH];
+	double normal_batch[RANDOM_BATCH];
+} __attribute__((aligned(64))); // Streams of different directions are used by different threads
+typedef struct random_t Random;
+
+
+void initRandom(struct vde_wirefilter_conn *vde_conn, const uint64_t seed);
+uint64_t randomSeed();
+
+void randomInit(Random *rng, const uint64_t seed, const unsigned int stream);
+uint64_t randomNext(Random *rng);
+void randomFill(Random *rng, double *out, const unsigned int count);
+void randomNormalFill(Random *rng, double *out, const unsigned int count);
+unsigned int randomGeometric(Random *rng, const double p, const unsigned int max);
+unsigned int randomBinomialDraw(Random *rng, const unsigned int n, const double p);
+unsigned int binomialInversion(Random *rng, const unsigned int n, const double p, double u);
+void randomIndexes(Random *rng, uint32_t *out, const unsigned int count, const uint32_t n);
+
+/* Returns a uniform number in [0, 1) */
+static inline double randomUniform(Random *rng) {
+	if (__builtin_expect(rng->next >= RANDOM_BATCH, 0)) {
+		randomFill(rng, rng->batch, RANDOM_BATCH);
+		rng->next = 0;
+	}
+	return rng->batch[rng->next++];
+}
+
+/* Returns a standard normal number */
+static inline double randomNormal(Random *rng) {
+	if (__builtin_expect(rng->next_normal >= RANDOM_BATCH, 0)) {
+		randomNormalFill(rng, rng->normal_batch, RANDOM_BATCH);
+		rng->next_normal = 0;
+	}
+	return rng->normal_batch[rng->next_normal++];
+}
+
+/**
+ * Number of successes of n trials with probability p.
+ * Most draws of a small mean are 0 (P(0) >= 1 - mean): they take a single uniform and no call.
+*/
+static inline unsigned int randomBinomial(Random *rng, const unsigned int n, const double p) {
+	double mean = n * p;
+
+	if (mean < 1 && p > 0) {
+		double u = randomUniform(rng);
+		return (u <= 1 - mean) ? 0 : binomialInversion(rng, n, p, u);
+	}
+	return randomBinomialDraw(rng, n, p);
+}
+
+#endif
@@ -0,0 +1,143 @@
+#include "./wf_ring.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "./wf_log.h"
+
+
+int initRing(Ring *ring, const unsigned int size) {
+	unsigned int real_size = 1;
+	while (real_size < size) { real_size <<= 1; } // Size must be a power of 2
+
+	ring->slots = malloc(real_size * sizeof(void *));
+	handle_error( ring->slots == NULL, { return -1; }, "Ring malloc error" );
+	ring->mask = real_size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->space_wanted = 0;
+
+	ring->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	handle_error( ring->eventfd < 0, { free(ring->slots); return -1; }, "Ring eventfd init error: %s", strerror(errno) );
+	ring->space_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	handle_error( ring->space_eventfd < 0, { close(ring->eventfd); free(ring->slots); return -1; }, "Ring eventfd init error: %s", strerror(errno) );
+
+	return 0;
+}
+
+void closeRing(Ring *ring) {
+	close(ring->eventfd);
+	close(ring->space_eventfd);
+	free(ring->slots);
+}
+
+
+/**
+ * Adds an item to the ring (producer side)
+ * Returns -1 if the ring is full
+*/
+int ringPush(Ring *ring, void *item) {
+	unsigned int tail = ring->tail;
+
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask) { return -1; }
+
+	ring->slots[tail & ring->mask] = item;
+	__atomic_store_n(&ring->tail, tail+1, __ATOMIC_RELEASE);
+
+	// Wakes up the consumer only if it already consumed everything before this item
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+		ringSignal(ring);
+	}
+
+	return 0;
+}
+
+/**
+ * Removes an item from the ring (consumer side)
+ * Returns NULL if the ring is empty
+*/
+void *ringPop(Ring *ring) {
+	unsigned int head = ring->head;
+
+	if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+		// Pairs with the producer fence, so that either the new item or the doorbell is seen
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) { return NULL; }
+	}
+
+	void *item = ring->slots[head & ring->mask];
+	__atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+/* Rings the doorbell, also used by consumers that stop before draining the whole ring */
+void ringSignal(Ring *ring) {
+	static const uint64_t one = 1;
+	handle_error( write(ring->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN, {}, "Ring doorbell error: %s", strerror(errno) );
+}
+
+/* Consumes the doorbell notification, must be done before draining the ring */
+void ringClearDoorbell(Ring *ring) {
+	uint64_t value;
+	handle_error( read(ring->eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN, {}, "Ring doorbell error: %s", strerror(errno) );
+}
+
+/**
+ * Clears the doorbell once the ring is empty, for consumers that do not drain the ring at once.
+ * This way the eventfd stays readable (level-triggered) as long as there are items to consume.
+*/
+void ringSettleDoorbell(Ring *ring) {
+	if (ringCount(ring) > 0) { return; }
+
+	ringClearDoorbell(ring);
+
+	// An item may have been pushed (and signaled) before the doorbell was cleared
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ringCount(ring) > 0) {
+		ringSignal(ring);
+	}
+}
+
+/* Number of items in the ring (approximate if called concurrently) */
+unsigned int ringCount(Ring *ring) {
+	return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ * Checks if the ring is full before pushing (producer side).
+ * If it is, the space doorbell is armed: it is rung by ringReleaseSpace once an item is consumed,
+ * so that the producer can stop producing until then. Returns 1 if the ring is full.
+*/
+char ringWaitSpace(Ring *ring) {
+	if (ringCount(ring) <= ring->mask) { return 0; }
+
+	__atomic_store_n(&ring->space_wanted, 1, __ATOMIC_RELAXED);
+
+	// Pairs with the consumer fence, so that either the freed slot or the request is seen
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ringCount(ring) <= ring->mask) {
+		__atomic_store_n(&ring->space_wanted, 0, __ATOMIC_RELAXED); // A stray doorbell is harmless
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Rings the space doorbell if a producer is waiting for it (consumer side, after a pop) */
+void ringReleaseSpace(Ring *ring) {
+	static const uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->space_wanted, __ATOMIC_RELAXED) && __atomic_exchange_n(&ring->space_wanted, 0, __ATOMIC_RELAXED)) {
+		handle_error( write(ring->space_eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN, {}, "Ring doorbell error: %s", strerror(errno) );
+	}
+}
+
+/* Consumes the space doorbell notification */
+void ringClearSpaceDoorbell(Ring *ring) {
+	uint64_t value;
+	handle_error( read(ring->space_eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN, {}, "Ring doorbell error: %s", strerror(errno) );
+}
@@ -0,0 +1,45 @@
+#ifndef INCLUDE_RING
+#define INCLUDE_RING
+
+#define RING_DEFAULT_SIZE 1024
+
+
+/**
+ * Bounded single-producer/single-consumer ring of pointers.
+ * The eventfd doorbell is signaled only when the ring goes from empty to non-empty,
+ * the consumer is expected to drain the whole ring at each wake up.
+ * A producer that cannot push can wait on the space doorbell, signaled by the consumer
+ * once the ring is no longer full (see ringWaitSpace).
+*/
+struct ring_t {
+	void **slots;
+	unsigned int mask;
+	int eventfd;
+	int space_eventfd; // Space doorbell, rung for a producer waiting on a full ring
+
+	// Producer and consumer indexes are kept on separate cache lines
+	char pad0[64];
+	unsigned int tail; // Written by the producer
+	char pad1[64];
+	unsigned int head; // Written by the consumer
+	char pad2[64];
+	unsigned int space_wanted; // Set by a producer waiting for space, cleared by the consumer
+	char pad3[64];
+};
+typedef struct ring_t Ring;
+
+
+int initRing(Ring *ring, const unsigned int size);
+void closeRing(Ring *ring);
+
+int ringPush(Ring *ring, void *item);
+void *ringPop(Ring *ring);
+void ringSignal(Ring *ring);
+void ringClearDoorbell(Ring *ring);
+void ringSettleDoorbell(Ring *ring);
+unsigned int ringCount(Ring *ring);
+char ringWaitSpace(Ring *ring);
+void ringReleaseSpace(Ring *ring);
+void ringClearSpaceDoorbell(Ring *ring);
+
+#endif
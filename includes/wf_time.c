@@ -1,27 +1,134 @@
 #include "./wf_time.h"
 #include <time.h>
-#include <sys/time.h>
 #include <sys/timerfd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "./wf_log.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAS_TSC
+#endif
 
-/* Returns the current timestamp in microseconds */
+#define TSC_CALIBRATION_NS	MS_TO_NS(10)	// Duration of the TSC frequency measurement
+#define TSC_RESYNC_NS		MS_TO_NS(100)	// Maximum time between two synchronizations with CLOCK_MONOTONIC
+#define TSC_SHIFT			32
+
+/*
+	The clock source is process-wide, as now_ns() is called without a connection.
+	It is only ever upgraded (to the TSC), so opening a connection never changes the clock of the
+	connections already open to a slower one. Both sources share the CLOCK_MONOTONIC timebase,
+	so a connection can run on either of them and timers are always armed on CLOCK_MONOTONIC.
+*/
+static char clock_source = CLOCK_SOURCE_MONOTONIC;
+
+#ifdef HAS_TSC
+static uint64_t tsc_mult;	// Nanoseconds per tick (fixed point)
+static uint64_t tsc_resync;	// Ticks after which the thread anchor is refreshed
+
+// Each thread extrapolates from its own anchor, so no synchronization is needed
+static __thread uint64_t anchor_tsc;
+static __thread uint64_t anchor_ns;
+static __thread uint64_t last_ns;
+#endif
+
+
+static uint64_t monotonic_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec*1000000000 + t.tv_nsec;
+}
+
+#ifdef HAS_TSC
+/* The TSC can be used only if its rate does not depend on the power state of the cpu */
+static int invariantTsc() {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) { return 0; }
+	return (edx & (1 << 8)) != 0;
+}
+
+static void calibrateTsc() {
+	struct timespec wait = { 0, TSC_CALIBRATION_NS };
+
+	uint64_t start_ns = monotonic_ns();
+	uint64_t start_tsc = __rdtsc();
+	nanosleep(&wait, NULL);
+	uint64_t end_ns = monotonic_ns();
+	uint64_t end_tsc = __rdtsc();
+
+	tsc_mult = ((end_ns - start_ns) << TSC_SHIFT) / (end_tsc - start_tsc);
+	tsc_resync = ((uint64_t)TSC_RESYNC_NS << TSC_SHIFT) / tsc_mult;
+}
+#endif
+
+/**
+ * Requests a source for now_ns(), the TSC is kept once selected by a connection.
+ * Returns the source actually in use.
+*/
+int initClock(const char source) {
+	static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef HAS_TSC
+	if (source == CLOCK_SOURCE_TSC) {
+		handle_error( !invariantTsc(), { return __atomic_load_n(&clock_source, __ATOMIC_ACQUIRE); }, "TSC is not invariant, using CLOCK_MONOTONIC" );
+
+		// The calibration is published before the source, now_ns() may be running in other threads
+		pthread_mutex_lock(&init_lock);
+		if (tsc_mult == 0) { calibrateTsc(); }
+		__atomic_store_n(&clock_source, CLOCK_SOURCE_TSC, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&init_lock);
+	}
+#else
+	(void)init_lock;
+	handle_error( source == CLOCK_SOURCE_TSC, {}, "TSC not available, using CLOCK_MONOTONIC" );
+#endif
+
+	return __atomic_load_n(&clock_source, __ATOMIC_ACQUIRE);
+}
+
+const char *clockSourceName() {
+	return (__atomic_load_n(&clock_source, __ATOMIC_ACQUIRE) == CLOCK_SOURCE_TSC) ? "tsc" : "monotonic";
+}
+
+
+/* Returns the current monotonic timestamp in nanoseconds */
 uint64_t now_ns() {
-	struct timeval v;
-	gettimeofday(&v,NULL);
-	return (uint64_t)(v.tv_sec*1000000000 + v.tv_usec*1000); 
+#ifdef HAS_TSC
+	if (__atomic_load_n(&clock_source, __ATOMIC_ACQUIRE) == CLOCK_SOURCE_TSC) {
+		uint64_t ticks = __rdtsc() - anchor_tsc;
+
+		if (__builtin_expect(anchor_ns == 0 || ticks > tsc_resync, 0)) {
+			anchor_ns = monotonic_ns();
+			anchor_tsc = __rdtsc();
+			ticks = 0;
+		}
+
+		// The anchor refresh may step slightly backwards
+		uint64_t now = anchor_ns + ((ticks * tsc_mult) >> TSC_SHIFT);
+		if (now > last_ns) { last_ns = now; }
+		return last_ns;
+	}
+#endif
+
+	return monotonic_ns();
 }
 
-/* Sets a timerfd, time is in nanoseconds */
-void setTimer(const int timefd, const uint64_t ns_time) {
-	time_t seconds = ns_time / (1000000000);
-	long nseconds = ns_time % (1000000000);
-	struct itimerspec next = { { 0, 0 }, { seconds, nseconds } };
-	
-	handle_error( timerfd_settime(timefd, 0, &next, NULL) == -1, { exit(1); }, "Error while setting timerfd: %s", strerror(errno) );
+
+/* Creates a timerfd on the same timebase of now_ns() */
+int newTimer() {
+	return timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+}
+
+/* Sets a timerfd to expire at an absolute time (in nanoseconds, as returned by now_ns()) */
+void setTimerAt(const int timefd, const uint64_t deadline_ns) {
+	// A zero deadline would disarm the timer, past deadlines expire immediately
+	uint64_t deadline = (deadline_ns > 0) ? deadline_ns : 1;
+	struct itimerspec next = { { 0, 0 }, { deadline / 1000000000, deadline % 1000000000 } };
+
+	handle_error( timerfd_settime(timefd, TFD_TIMER_ABSTIME, &next, NULL) == -1, { exit(1); }, "Error while setting timerfd: %s", strerror(errno) );
 }
 
 void disarmTimer(const int timefd) {
 	static const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
 	handle_error( timerfd_settime(timefd, 0, &disarm_timer, NULL) == -1, { exit(1); }, "Error while disarming timerfd: %s", strerror(errno) );
-}
\ No newline at end of file
+}
@@ -6,9 +6,17 @@
 #define MS_TO_NS(ms) ((ms) * 1000000)
 #define NS_TO_MS(ns) ((ns) / 1000000)
 #define NS_TO_US(ns) ((ns) / 1000)
+#define US_TO_NS(us) ((us) * 1000)
+
+#define CLOCK_SOURCE_MONOTONIC	0
+#define CLOCK_SOURCE_TSC		1 // Calibrated against CLOCK_MONOTONIC, falls back to it if not invariant
+
+int initClock(const char source);
+const char *clockSourceName();
 
 uint64_t now_ns();
-void setTimer(const int timefd, const uint64_t ns_time);
+int newTimer();
+void setTimerAt(const int timefd, const uint64_t deadline_ns);
 void disarmTimer(const int timefd);
 
-#endif
\ No newline at end of file
+#endif
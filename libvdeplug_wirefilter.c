@@ -23,24 +23,26 @@
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <libvdeplug.h>
 #include <libvdeplug_mod.h>
 #include <pthread.h>
 #include <poll.h>
 #include <time.h>
-#include <sys/time.h>
-#include <sys/timerfd.h>
 #include <wf_conn.h>
 #include <wf_queue.h>
 #include <wf_time.h>
 #include <wf_markov.h>
 #include <wf_management.h>
+#include <wf_loop.h>
 #include <wf_log.h>
 
 
 #define DROP -1
 #define FORWARD 0
 
+#define NOISE_FLIP_BATCH 32 // Positions of broken bits drawn at once
+
 
 static VDECONN *vde_wirefilter_open(char *vde_url, char *descr, int interface_version, struct vde_open_args *open_args);
 static ssize_t vde_wirefilter_recv(VDECONN *conn, void *buf, size_t len, int flags);
@@ -60,22 +62,19 @@ struct vdeplug_module vdeplug_ops = {
 	.vde_close = vde_wirefilter_close
 };
 
+static int startHandlers(struct vde_wirefilter_conn *vde_conn, const char split_directions);
 static void *packetHandlerThread(void *param);
-static void handlePacket(struct vde_wirefilter_conn *vde_conn, const Packet *packet);
+static void handlePacket(struct vde_wirefilter_conn *vde_conn, Packet *packet);
 static void sendPacket(struct vde_wirefilter_conn *vde_conn, Packet *packet);
 
-static char mtuHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet);
-static char lossHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet);
-static int duplicatesHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet);
-static char bufferSizeHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet);
-static double bandwidthHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet);
-static double speedHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet);
-static double delayHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet);
-static Packet *noiseHandler(struct vde_wirefilter_conn *vde_conn, Packet *packet);
-
-static int openBlinkSocket(struct vde_wirefilter_conn *vde_conn, char *socket_path);
-static int setBlinkId(struct vde_wirefilter_conn *vde_conn, char *id);
-static void closeBlink(struct vde_wirefilter_conn *vde_conn);
+static char mtuHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet);
+static char lossHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet);
+static int duplicatesHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet);
+static char bufferSizeHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet);
+static double bandwidthHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet);
+static double speedHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet);
+static double delayHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet);
+static Packet *noiseHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, Packet *packet);
 
 static int savePidFile(char *path);
 
@@ -85,48 +84,58 @@ static VDECONN *vde_wirefilter_open(char *vde_url, char *descr, int interface_ve
 
 	init_logs();
 
-	// Random seed
-	struct timeval v;
-	gettimeofday(&v,NULL);
-	srand48(v.tv_sec ^ v.tv_usec ^ getpid());
-
 	struct vde_wirefilter_conn *new_conn = NULL;
 	VDECONN *nested_conn;
 	char *nested_vnl;
 	char *rc_path = NULL;
 	char *delay_str = NULL;
-	char *dup_str = NULL;
+	char *dup_str = NULL, *dup_max_str = NULL;
 	char *loss_str = NULL;
 	char *bursty_loss_str = NULL;
 	char *mtu_str = NULL;
 	char *nofifo_str = NULL;
+	char *queue_engine_str = NULL, *wheel_tick_str = NULL, *timer_slack_str = NULL;
 	char *channel_size_str = NULL;
 	char *bandwidth_str = NULL;
-	char *speed_str = NULL;
+	char *speed_str = NULL, *speed_mode_str = NULL, *speed_queue_str = NULL;
 	char *noise_str = NULL;
-	char *blink_path_str = NULL, *blink_id_str = NULL;
+	char *blink_path_str = NULL, *blink_id_str = NULL, *blink_sample_str = NULL, *blink_interval_str = NULL;
 	char *management_socket_path = NULL, *management_mode_str = NULL;
 	char *pid_file_path = NULL;
+	char *pool_size_str = NULL;
+	char *ring_size_str = NULL, *backpressure_str = NULL;
+	char *dir_threads_str = NULL;
+	char *clock_str = NULL;
+	char *seed_str = NULL;
 	struct vdeparms parms[] = {
 		{ "rc", &rc_path },
 		{ "delay", &delay_str },
-		{ "dup", &dup_str },
+		{ "dup", &dup_str }, { "dupmax", &dup_max_str },
 		{ "loss", &loss_str },
 		{ "lostburst", &bursty_loss_str },
 		{ "mtu", &mtu_str },
 		{ "nofifo", &nofifo_str },
+		{ "queue", &queue_engine_str }, { "wheeltick", &wheel_tick_str }, { "timerslack", &timer_slack_str },
 		{ "bufsize", &channel_size_str },
 		{ "bandwidth", &bandwidth_str },
-		{ "speed", &speed_str },
+		{ "speed", &speed_str }, { "speedmode", &speed_mode_str }, { "speedqueue", &speed_queue_str },
 		{ "noise", &noise_str },
 		{ "blink", &blink_path_str }, { "blinkid", &blink_id_str },
+		{ "blinksample", &blink_sample_str }, { "blinkinterval", &blink_interval_str },
 		{ "mgmt", &management_socket_path }, { "mgmtmode", &management_mode_str },
 		{ "pidfile", &pid_file_path },
+		{ "poolsize", &pool_size_str },
+		{ "ringsize", &ring_size_str }, { "backpressure", &backpressure_str },
+		{ "dirthreads", &dir_threads_str },
+		{ "clock", &clock_str },
+		{ "seed", &seed_str },
 		{ NULL, NULL }
 	};
 
 	nested_vnl = vde_parsenestparms(vde_url);											// Gets the nested VNL
 	handle_error( vde_parsepathparms(vde_url, parms) != 0, { return NULL; }, NULL );	// Retrieves the plugin parameters
+
+	initClock((clock_str && strcmp(clock_str, "tsc") == 0) ? CLOCK_SOURCE_TSC : CLOCK_SOURCE_MONOTONIC);
 	
 	// Opens the connection with the nested VNL
 	nested_conn = vde_open(nested_vnl, descr, open_args);
@@ -135,15 +144,22 @@ static VDECONN *vde_wirefilter_open(char *vde_url, char *descr, int interface_ve
 	new_conn = calloc(1, sizeof(struct vde_wirefilter_conn));
 	handle_error( new_conn == NULL, { goto error; }, NULL );
 	new_conn->conn = nested_conn;
+	new_conn->dup_max = dup_max_str ? strtoul(dup_max_str, NULL, 10) : DUP_DEFAULT_MAX;
 
-	// Pipes initialization
-	new_conn->send_pipefd = malloc(2*sizeof(int));
-	new_conn->receive_pipefd = malloc(2*sizeof(int));
-	handle_error( pipe(new_conn->send_pipefd) != 0, { goto error; }, NULL );
-	handle_error( pipe(new_conn->receive_pipefd) != 0, { goto error; }, NULL );
+	handle_error( initPool(&new_conn->pool, pool_size_str ? atoi(pool_size_str) : 0) < 0, { goto error; }, NULL );
 
-	handle_error( initQueue(new_conn, nofifo_str == NULL ? FIFO : NO_FIFO) < 0, { goto error; }, NULL );
+	// Packet handoff initialization
+	handle_error( initRing(&new_conn->send_ring, ring_size_str ? atoi(ring_size_str) : RING_DEFAULT_SIZE) < 0, { goto error; }, NULL );
+	new_conn->backpressure = (backpressure_str && strcmp(backpressure_str, "drop") == 0) ? BACKPRESSURE_DROP : BACKPRESSURE_EAGAIN;
+	handle_error( initRing(&new_conn->receive_ring, ring_size_str ? atoi(ring_size_str) : RING_DEFAULT_SIZE) < 0, { goto error; }, NULL );
+
+	handle_error( initQueue(new_conn, nofifo_str == NULL ? FIFO : NO_FIFO,
+							(queue_engine_str && strcmp(queue_engine_str, "wheel") == 0) ? QUEUE_WHEEL : QUEUE_HEAP,
+							wheel_tick_str ? US_TO_NS(atoll(wheel_tick_str)) : WHEEL_DEFAULT_TICK_NS) < 0, { goto error; }, NULL );
+	new_conn->queue.timer_slack = timer_slack_str ? US_TO_NS(atoll(timer_slack_str)) : 0;
+	new_conn->stats_since = now_ns();
 	handle_error( initMarkov(new_conn, 1, 0, MS_TO_NS(100)) < 0, { goto error; }, NULL );
+	initRandom(new_conn, seed_str ? strtoull(seed_str, NULL, 0) : randomSeed());
 	
 	setWireValue(new_conn, DELAY, delay_str, 0);
 	setWireValue(new_conn, DUP, dup_str, 0);
@@ -154,16 +170,12 @@ static VDECONN *vde_wirefilter_open(char *vde_url, char *descr, int interface_ve
 	setWireValue(new_conn, BANDWIDTH, bandwidth_str, 0);
 	setWireValue(new_conn, SPEED, speed_str, 0);
 	setWireValue(new_conn, NOISE, noise_str, 0);
-	new_conn->speed_next[LEFT_TO_RIGHT] = 0;
-	new_conn->speed_next[RIGHT_TO_LEFT] = 0;
-	new_conn->speed_timer = timerfd_create(CLOCK_REALTIME, 0);
-	handle_error( new_conn->speed_timer < 0, { goto error; }, NULL );
-	new_conn->bandwidth_next[LEFT_TO_RIGHT] = 0;
-	new_conn->bandwidth_next[RIGHT_TO_LEFT] = 0;
+	new_conn->speed_mode = (speed_mode_str && strcmp(speed_mode_str, "nonblock") == 0) ? SPEED_MODE_NONBLOCK : SPEED_MODE_BLOCK;
+	new_conn->speed_queue = speed_queue_str ? strtoul(speed_queue_str, NULL, 10) : new_conn->send_ring.mask + 1;
+	if (new_conn->speed_queue == 0) { new_conn->speed_queue = 1; }
 
 	if (blink_path_str) { 
-		handle_error( openBlinkSocket(new_conn, blink_path_str) < 0, { goto error; }, NULL );
-		handle_error( setBlinkId(new_conn, blink_id_str) < 0, { goto error; }, NULL );
+		handle_error( initBlink(&new_conn->blink, blink_path_str, blink_id_str, blink_sample_str, blink_interval_str) < 0, { goto error; }, NULL );
 	}
 
 	new_conn->management.socket_fd = -1;
@@ -172,16 +184,15 @@ static VDECONN *vde_wirefilter_open(char *vde_url, char *descr, int interface_ve
 	}
 
 	if (rc_path) {
-		handle_error( loadConfig(new_conn, -1, rc_path) < 0, { goto error; }, NULL );
+		handle_error( loadConfig(new_conn, -1, rc_path) != 0, { goto error; }, NULL );
 	}
 
 	if (pid_file_path) {
 		handle_error( savePidFile(pid_file_path) < 0, { goto error; }, NULL );
 	}
 
-	// Starts packet handler thread
-	handle_error( pthread_mutex_init(&new_conn->receive_lock, NULL) != 0, { goto error; }, NULL );
-	handle_error( pthread_create(&new_conn->packet_handler_thread, NULL, &packetHandlerThread, (void*)new_conn) != 0, { goto error; }, NULL );
+	// Starts packet handler threads
+	handle_error( startHandlers(new_conn, dir_threads_str != NULL) < 0, { goto error; }, NULL );
 
 	return (VDECONN *)new_conn;
 
@@ -195,26 +206,30 @@ static ssize_t vde_wirefilter_recv(VDECONN *conn, void *buf, size_t len, int fla
 	/* 
 		Note: Packets from the nested plugin (right side) are intercepted by the packet handler thread first
 	*/
-	(void)len; (void)flags;
+	(void)flags;
 	struct vde_wirefilter_conn *vde_conn = (struct vde_wirefilter_conn *)conn;
+	Packet *packet;
 
 	const int POLL_SIZE = 1;
 	struct pollfd poll_fd[1] = {
-		{ .fd=vde_conn->receive_pipefd[0], .events=POLLIN }
+		{ .fd=vde_conn->receive_ring.eventfd, .events=POLLIN }
 	};
 
-	if ( poll(poll_fd, POLL_SIZE, -1) > 0 ) {
-		// A packet arrived from the thread (which means that it can be received)
-		if (poll_fd[0].revents & POLLIN) {
-			ssize_t read_len = read(vde_conn->receive_pipefd[0], buf, VDE_ETHBUFSIZE);
-			pthread_mutex_unlock(&vde_conn->receive_lock);
-			
-			handle_error( read_len < 0, { goto error; }, "Thread error on receive pipe" );
-
-			return read_len;
-		}
+	// Waits for the thread to deliver a packet
+	while ((packet = ringPop(&vde_conn->receive_ring)) == NULL) {
+		handle_error( poll(poll_fd, POLL_SIZE, -1) < 0, { goto error; }, NULL );
 	}
 
+	ssize_t read_len = (packet->len < len) ? packet->len : len;
+	memcpy(buf, packet->buf, read_len);
+	packetDestroy(packet);
+	ringReleaseSpace(&vde_conn->receive_ring);
+
+	// Keeps the data fd readable only while there are packets to receive
+	ringSettleDoorbell(&vde_conn->receive_ring);
+
+	return read_len;
+
 	error:
 		errno = EAGAIN;
 		return 1;
@@ -225,15 +240,22 @@ static ssize_t vde_wirefilter_send(VDECONN *conn, const void *buf, size_t len, i
 	struct vde_wirefilter_conn *vde_conn = (struct vde_wirefilter_conn *)conn;
 	uint64_t now = now_ns();
 
-	// Speed delay handling
-	if (vde_conn->speed_next[LEFT_TO_RIGHT] > now) {
-		usleep( NS_TO_US(vde_conn->speed_next[LEFT_TO_RIGHT] - now) );
+	// Speed delay handling (in non-blocking mode the handler waits instead)
+	if (vde_conn->speed_mode == SPEED_MODE_BLOCK && vde_conn->shaping[LEFT_TO_RIGHT].speed_next > now) {
+		usleep( NS_TO_US(vde_conn->shaping[LEFT_TO_RIGHT].speed_next - now) );
+	}
+
+	// A frame that does not fit a buffer can never be sent, it is discarded as by the mtu
+	if (len > VDE_ETHBUFSIZE) {
+		STATS_DROP_ATOMIC(vde_conn, LEFT_TO_RIGHT, DROP_MTU);
+		return 0;
 	}
 
-	Packet *packet = malloc(sizeof(Packet));
-	handle_error( packet == NULL, { goto error; }, "Send packet malloc error" );
-	packet->buf = malloc(len);
-	handle_error( packet->buf == NULL, { goto error; }, "Send packet payload malloc error" );
+	// Non-blocking speed handling, no more than speed_queue packets wait for the interface
+	if (vde_conn->speed_mode == SPEED_MODE_NONBLOCK && ringCount(&vde_conn->send_ring) >= vde_conn->speed_queue) { goto ring_full; }
+
+	Packet *packet = poolAlloc(&vde_conn->pool);
+	handle_error( packet == NULL, { STATS_DROP_ATOMIC(vde_conn, LEFT_TO_RIGHT, DROP_POOL); goto error; }, NULL ); // Pool exhausted
 
 	memcpy(packet->buf, buf, len);
 	packet->len = len;
@@ -241,10 +263,19 @@ static ssize_t vde_wirefilter_send(VDECONN *conn, const void *buf, size_t len, i
 	packet->direction = LEFT_TO_RIGHT;
 
 	// Passes the packet to the handler
-	handle_error( write(vde_conn->send_pipefd[1], (void*)&packet, sizeof(void*)) < 0, { goto error; }, "Thread error on send pipe" );
+	if (ringPush(&vde_conn->send_ring, packet) < 0) {
+		packetDestroy(packet);
+		goto ring_full;
+	}
 
 	return 0;
 
+	// The handler is not keeping up (or the interface is busy)
+	ring_full:
+		if (vde_conn->backpressure == BACKPRESSURE_EAGAIN) { goto error; }
+		STATS_DROP_ATOMIC(vde_conn, LEFT_TO_RIGHT, DROP_RING);
+		return 0;
+
 	error:
 		errno = EAGAIN;
 		return -1;
@@ -252,7 +283,7 @@ static ssize_t vde_wirefilter_send(VDECONN *conn, const void *buf, size_t len, i
 
 static int vde_wirefilter_datafd(VDECONN *conn) {
 	struct vde_wirefilter_conn *vde_conn = (struct vde_wirefilter_conn *)conn;
-	return vde_conn->receive_pipefd[0];
+	return vde_conn->receive_ring.eventfd;
 }
 
 static int vde_wirefilter_ctlfd(VDECONN *conn) {
@@ -263,292 +294,476 @@ static int vde_wirefilter_ctlfd(VDECONN *conn) {
 static int vde_wirefilter_close(VDECONN *conn) {
 	struct vde_wirefilter_conn *vde_conn = (struct vde_wirefilter_conn *)conn;
 
-	pthread_cancel(vde_conn->packet_handler_thread);
-	pthread_mutex_destroy(&vde_conn->receive_lock);
+	// Handler threads can only be canceled while waiting for events, so no lock is left held
+	for (int i=0; i<vde_conn->handlers_count; i++) { pthread_cancel(vde_conn->handlers[i].thread); }
+	for (int i=0; i<vde_conn->handlers_count; i++) { 
+		pthread_join(vde_conn->handlers[i].thread, NULL); 
+		closeLoop(&vde_conn->handlers[i].loop);
+	}
+	pthread_rwlock_destroy(&vde_conn->wire_lock);
 
-	close(vde_conn->send_pipefd[0]);
-	close(vde_conn->send_pipefd[1]);
-	close(vde_conn->receive_pipefd[0]);
-	close(vde_conn->receive_pipefd[1]);
-	free(vde_conn->send_pipefd);
-	free(vde_conn->receive_pipefd);
-	close(vde_conn->speed_timer);
+	closeRing(&vde_conn->send_ring);
+	closeRing(&vde_conn->receive_ring);
 	closeQueue(vde_conn);
 	closeMarkov(vde_conn);
+	closePool(&vde_conn->pool);
 	if (vde_conn->management.socket_fd > 0) { closeManagement(vde_conn); }
-	if (vde_conn->blink.socket_fd > 0) { closeBlink(vde_conn); }
+	if (vde_conn->blink.socket_fd > 0) { closeBlink(&vde_conn->blink); }
 	
 	int ret_value = vde_close(vde_conn->conn); // Closes nested connection
 	free(vde_conn);
 	return ret_value;
 }
 
-#define POLL_PIPE_LR 		0
-#define POLL_PIPE_RL 		1
-#define POLL_QUEUE_TIMER 	2
-#define POLL_SPEED_TIMER	3
-#define POLL_MARKOV_TIMER	4
-#define POLL_MNGM 			5
+#define HANDLER_BATCH 64 // Packets handled before letting a writer take the wire lock
+#define HANDLER_BUDGET 1024 // Packets taken from the send ring or the nested plugin before serving the other events
+
+/**
+ * Starts the packet handler threads.
+ * Directions are handled by a single thread or, if split, by a thread each
+ * (with a third thread for the Markov chain and the management socket).
+*/
+static int startHandlers(struct vde_wirefilter_conn *vde_conn, const char split_directions) {
+	pthread_rwlockattr_t lock_attr;
+	const int roles[HANDLER_MAX_THREADS] = { HANDLER_LR, HANDLER_RL, HANDLER_CONTROL };
+
+	// Packets are handled continuously, configuration changes must not starve
+	pthread_rwlockattr_init(&lock_attr);
+	pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	handle_error( pthread_rwlock_init(&vde_conn->wire_lock, &lock_attr) != 0, { return -1; }, "Wire lock init error" );
+	pthread_rwlockattr_destroy(&lock_attr);
+
+	vde_conn->handlers_count = 0;
+	
+	for (int i=0; i<(split_directions ? HANDLER_MAX_THREADS : 1); i++) {
+		HandlerThread *handler = &vde_conn->handlers[i];
+		handler->vde_conn = vde_conn;
+		handler->roles = split_directions ? roles[i] : HANDLER_ALL;
+
+		handle_error( initLoop(&handler->loop, vde_conn) < 0, { return -1; }, NULL );
+		handle_error( pthread_create(&handler->thread, NULL, &packetHandlerThread, (void*)handler) != 0, { closeLoop(&handler->loop); return -1; }, "Handler thread creation error" );
+		vde_conn->handlers_count++;
+	}
 
-static void *packetHandlerThread(void *param) {
-	pthread_detach(pthread_self());
+	return 0;
+}
 
-	struct vde_wirefilter_conn *vde_conn = (struct vde_wirefilter_conn *)param;
-	
-	const int POLL_SIZE = 6+MNGM_MAX_CONN;
-	struct pollfd poll_fd[6+MNGM_MAX_CONN] = {
-		{ .fd=vde_conn->send_pipefd[0], .events=POLLIN },					// Left to right packets
-		{ .fd=vde_datafd(vde_conn->conn), .events=POLLIN },					// Right to left packets
-		{ .fd=vde_conn->queue.timerfd, .events=POLLIN },					// Packet queue timer
-		{ .fd=vde_conn->speed_timer, .events=POLLIN },						// Packet speed timer
-		{ .fd=vde_conn->markov.timerfd, .events=POLLIN },					// Markov chain state change
-		{ .fd=vde_conn->management.socket_fd, .events=POLLIN },				// Management socket
-	};
-	for (int i=1; i<=MNGM_MAX_CONN; i++) { poll_fd[POLL_MNGM + i].fd = -1; } // Management socket clients
+/* Sends the delayed packets of a direction that are due, expired is set when the queue timer woke up the handler */
+static void flushQueue(struct vde_wirefilter_conn *vde_conn, const int direction, const char expired) {
+	DelayQueue *queue = &vde_conn->queue.dir[direction];
+	uint64_t now = now_ns();
 
-	ssize_t rw_len;
-	unsigned char receive_buffer[VDE_ETHBUFSIZE];
-	uint64_t now;
+	// The overshoot is read by the management under the write lock
+	pthread_rwlock_rdlock(&vde_conn->wire_lock);
+	if (expired && now > queue->timer.deadline) {
+		uint64_t overshoot = now - queue->timer.deadline;
+		queue->overshoot.samples++;
+		queue->overshoot.total_ns += overshoot;
+		if (overshoot > queue->overshoot.max_ns) { queue->overshoot.max_ns = overshoot; }
+	}
 
+	uint64_t forward_time;
+	while (queue->size > 0 && (forward_time = nextQueueTime(vde_conn, direction)) <= now) {
+		// The receive ring is full, the packets wait in the queue until the application receives (see onReceiveSpace)
+		if (direction == RIGHT_TO_LEFT && ringWaitSpace(&vde_conn->receive_ring)) { goto exit; }
 
-	// Starts Markov timer
-	setTimer(vde_conn->markov.timerfd, vde_conn->markov.change_frequency);
+		uint64_t release_time = now_ns();
+		histogramRecord(&queue->lateness, (release_time > forward_time) ? release_time - forward_time : 0);
+		sendPacket(vde_conn, dequeue(vde_conn, direction));
+	}
 
+	// Sets the timer for the next packet
+	setQueueTimer(vde_conn, direction);
 
-	while(1) {
-		if (poll(poll_fd, POLL_SIZE, -1) > 0) {
+	exit:
+		pthread_rwlock_unlock(&vde_conn->wire_lock);
+}
 
-			// A packet has to be sent
-			if (poll_fd[POLL_PIPE_LR].revents & POLLIN) {
-				Packet *packet;
-				rw_len = read(vde_conn->send_pipefd[0], &packet, sizeof(void*));
-				handle_error( rw_len < 0, {}, "Error while reading send pipe");
 
-				handlePacket(vde_conn, packet);
-				packetDestroy(packet);
-			}
+/**
+ * Speed handling: returns 1 if the interface of a direction is still busy,
+ * its speed timer is then armed at the time it becomes free.
+*/
+static char speedWait(struct vde_wirefilter_conn *vde_conn, const int direction) {
+	uint64_t speed_next = vde_conn->shaping[direction].speed_next;
+	if (speed_next <= now_ns()) { return 0; }
 
+	timerSet(&vde_conn->speed_timer[direction], speed_next);
+	return 1;
+}
 
-			// A packet can be received from the nested plugin
-			if (poll_fd[POLL_PIPE_RL].revents & POLLIN) {
-				now = now_ns();
+/* Left to right packets have to be sent */
+static void onSendRing(EventLoop *loop, EventHandler *handler, const uint32_t events) {
+	(void)handler; (void)events;
+	struct vde_wirefilter_conn *vde_conn = loop->vde_conn;
+	Packet *packet = NULL;
+	int handled = 0;
+
+	// The doorbell is edge-triggered, it does not need to be consumed
+	pthread_rwlock_rdlock(&vde_conn->wire_lock);
+	while (handled < HANDLER_BUDGET) {
+		// Non-blocking speed handling, packets wait in the send ring while the interface is busy
+		if (vde_conn->speed_mode == SPEED_MODE_NONBLOCK && speedWait(vde_conn, LEFT_TO_RIGHT)) { packet = NULL; break; }
+		if ((packet = ringPop(&vde_conn->send_ring)) == NULL) { break; }
+
+		handlePacket(vde_conn, packet);
+
+		if (++handled % HANDLER_BATCH == 0) {
+			pthread_rwlock_unlock(&vde_conn->wire_lock);
+			pthread_rwlock_rdlock(&vde_conn->wire_lock);
+		}
+	}
+	pthread_rwlock_unlock(&vde_conn->wire_lock);
 
-				// Speed handling
-				if (vde_conn->speed_next[RIGHT_TO_LEFT] > now) {
-					poll_fd[POLL_PIPE_RL].events &= ~POLLIN; // Stop receiving packets
-					setTimer(vde_conn->speed_timer, (vde_conn->speed_next[RIGHT_TO_LEFT] - now));
-				}
-				else {
-					rw_len = vde_recv(vde_conn->conn, receive_buffer, VDE_ETHBUFSIZE, 0);
-					handle_error( rw_len < 0, { continue; }, "Error while reading receive pipe");
-					
-					if (rw_len > 1) { // Not discarded packet
-						Packet *packet = malloc(sizeof(Packet));
-						handle_error( packet == NULL, { continue; }, "Thread receive packet malloc error");
-						packet->buf = malloc(rw_len);
-						handle_error( packet->buf == NULL, { continue; }, "Thread receive packet payload malloc error");
-						memcpy(packet->buf, receive_buffer, rw_len);
-						packet->len = rw_len;
-						packet->flags = 0;
-						packet->direction = RIGHT_TO_LEFT;
-
-						handlePacket(vde_conn, packet);
-						packetDestroy(packet);
-					}
-				}
-			}
+	// Budget exhausted, the remaining packets are handled after the other pending events
+	if (packet != NULL) { ringSignal(&vde_conn->send_ring); }
+}
 
+/* A packet can be received from the nested plugin */
+static void onNestedData(EventLoop *loop, EventHandler *handler, const uint32_t events) {
+	(void)events;
+	struct vde_wirefilter_conn *vde_conn = loop->vde_conn;
+	struct pollfd poll_fd = { .fd=handler->fd, .events=POLLIN };
+	ssize_t rw_len;
+	int handled = 0;
+
+	// The data fd is level-triggered, the packets left after the budget are received after the other pending events
+	pthread_rwlock_rdlock(&vde_conn->wire_lock);
+	while (handled < HANDLER_BUDGET) {
+		// Speed handling
+		if (speedWait(vde_conn, RIGHT_TO_LEFT)) {
+			loopModify(loop, handler, 0); // Stop receiving packets
+			break;
+		}
 
-			// Time to send something
-			if (poll_fd[POLL_QUEUE_TIMER].revents & POLLIN) {
-				disarmTimer(vde_conn->queue.timerfd);
+		// Backpressure, packets wait in the nested plugin until the application receives from the full ring
+		if (ringWaitSpace(&vde_conn->receive_ring)) {
+			loopModify(loop, handler, 0);
+			break;
+		}
 
-				Packet *packet;
-				while (vde_conn->queue.size > 0 && nextQueueTime(vde_conn) < now_ns()) {
-					packet = dequeue(vde_conn);
-					sendPacket(vde_conn, packet);
-				}
+		// The nested receive may block, further packets are received only if ready
+		if (handled > 0 && poll(&poll_fd, 1, 0) <= 0) { break; }
 
-				// Sets the timer for the next packet
-				if (vde_conn->queue.size > 0) {
-					setQueueTimer(vde_conn);
-				}
-			}
-			
+		// The action of handle_error cannot break out of the loop
+		Packet *packet = poolAlloc(&vde_conn->pool);
+		if (packet == NULL) {
+			print_log(LOG_ERR, "Thread receive packet error (pool exhausted)");
+			STATS_DROP_ATOMIC(vde_conn, RIGHT_TO_LEFT, DROP_POOL);
+			break;
+		}
 
-			// Packets reception (right to left) can be restored (speed handling)
-			if (poll_fd[POLL_SPEED_TIMER].revents & POLLIN) {
-				disarmTimer(vde_conn->speed_timer);
-				poll_fd[POLL_PIPE_RL].events |= POLLIN; // Restart receiving packets
-			}
+		rw_len = vde_recv(vde_conn->conn, packet->buf, VDE_ETHBUFSIZE, 0);
+		if (rw_len < 0) {
+			print_log(LOG_ERR, "Error while reading receive pipe");
+			packetDestroy(packet);
+			break;
+		}
 
+		if (rw_len > 1) { // Not discarded packet
+			packet->len = rw_len;
+			packet->flags = 0;
+			packet->direction = RIGHT_TO_LEFT;
+			handlePacket(vde_conn, packet);
+		}
+		else {
+			packetDestroy(packet);
+		}
 
-			// Time to change markov chain state
-			if (poll_fd[POLL_MARKOV_TIMER].revents & POLLIN) {
-				setTimer(vde_conn->markov.timerfd, vde_conn->markov.change_frequency);
-				markovStep(vde_conn, vde_conn->markov.current_node);
-			}
+		if (++handled % HANDLER_BATCH == 0) {
+			pthread_rwlock_unlock(&vde_conn->wire_lock);
+			pthread_rwlock_rdlock(&vde_conn->wire_lock);
+		}
+	}
+	pthread_rwlock_unlock(&vde_conn->wire_lock);
+}
 
+/* The application received from the full receive ring, the delayed packets and the reception (right to left) can go on */
+static void onReceiveSpace(EventLoop *loop, EventHandler *handler, const uint32_t events) {
+	(void)events;
+	ringClearSpaceDoorbell(&loop->vde_conn->receive_ring);
+	flushQueue(loop->vde_conn, RIGHT_TO_LEFT, 0);
+	loopModify(loop, (EventHandler *)handler->arg, EPOLLIN);
+}
 
-			// Management socket connection
-			if (poll_fd[POLL_MNGM].revents & POLLIN) {
-				int new_conn = acceptManagementConnection(vde_conn);
+/* Packets reception (right to left) can be restored (speed handling) */
+static void onSpeedTimer(EventLoop *loop, LoopTimer *timer) {
+	loopModify(loop, (EventHandler *)timer->arg, EPOLLIN); // Restart receiving packets
+}
 
-				if (new_conn > 0) {
-					poll_fd[POLL_MNGM + vde_conn->management.connections_count].fd = new_conn;
-					poll_fd[POLL_MNGM + vde_conn->management.connections_count].events = POLLIN | POLLHUP;
-				}
-			}
+/* Packets to send (left to right) can be taken from the send ring again (non-blocking speed handling) */
+static void onSendSpeedTimer(EventLoop *loop, LoopTimer *timer) {
+	(void)timer;
+	ringSignal(&loop->vde_conn->send_ring);
+}
 
-			// Management socket command
-			for (int i=1; i<=vde_conn->management.connections_count; i++) {
-				if (poll_fd[POLL_MNGM + i].revents & POLLIN) {
-					handleManagementCommand(vde_conn, poll_fd[POLL_MNGM + i].fd);
-				}
-			}
+/* Time to send something */
+static void onQueueTimer(EventLoop *loop, LoopTimer *timer) {
+	flushQueue(loop->vde_conn, (int)(intptr_t)timer->arg, 1);
+}
 
-			// Management socket hang-up
-			for (int i=1; i<=vde_conn->management.connections_count; i++) {
-				if (poll_fd[POLL_MNGM + i].revents & POLLHUP) {
-					closeManagementConnection(vde_conn, poll_fd[POLL_MNGM + i].fd);
+/* Time to change markov chain state */
+static void onMarkovTimer(EventLoop *loop, LoopTimer *timer) {
+	(void)timer;
+	struct vde_wirefilter_conn *vde_conn = loop->vde_conn;
 
-					// Shifts poll fds
-					memmove(&poll_fd[POLL_MNGM+i], &poll_fd[POLL_MNGM+i+1], sizeof(struct pollfd) * (vde_conn->management.connections_count-i));
-					poll_fd[POLL_MNGM+vde_conn->management.connections_count].fd = -1;
+	markovSetTimer(vde_conn, 0);
+	pthread_rwlock_wrlock(&vde_conn->wire_lock);
+	markovStep(vde_conn, vde_conn->markov.current_node);
+	pthread_rwlock_unlock(&vde_conn->wire_lock);
+}
 
-					vde_conn->management.connections_count--;
-					i--;
-				}
-			}
+/* Time to send the blink messages */
+static void onBlinkTimer(EventLoop *loop, LoopTimer *timer) {
+	Blink *blink = &loop->vde_conn->blink;
+
+	blinkSetTimer(blink, 0);
+	// The listener is not keeping up, the flush goes on when it can receive again
+	if (blinkFlush(blink)) { loopModify(loop, (EventHandler *)timer->arg, EPOLLOUT); }
+}
+
+/* The blink listener can receive again */
+static void onBlinkSocket(EventLoop *loop, EventHandler *handler, const uint32_t events) {
+	(void)events;
+	if (!blinkFlush(&loop->vde_conn->blink)) { loopModify(loop, handler, 0); }
+}
+
+/* Management socket command or hang-up */
+static void onManagementClient(EventLoop *loop, EventHandler *handler, const uint32_t events) {
+	struct vde_wirefilter_conn *vde_conn = loop->vde_conn;
+	MngmClient *client = (MngmClient *)handler->arg;
+
+	if (events & EPOLLIN) {
+		// Commands may change the wire and the queues
+		pthread_rwlock_wrlock(&vde_conn->wire_lock);
+		handleManagementCommand(vde_conn, client->fd);
+		pthread_rwlock_unlock(&vde_conn->wire_lock);
+	}
+
+	if (events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+		loopRemove(loop, handler);
+		closeManagementConnection(vde_conn, client);
+	}
+}
+
+/* Management socket connection */
+static void onManagementSocket(EventLoop *loop, EventHandler *handler, const uint32_t events) {
+	(void)handler; (void)events;
+	MngmClient *client = acceptManagementConnection(loop->vde_conn);
+	if (client == NULL) { return; }
+
+	client->handler = (EventHandler){ .fd=client->fd, .callback=onManagementClient, .arg=client };
+	handle_error( loopAdd(loop, &client->handler, EPOLLIN | EPOLLRDHUP) < 0, { closeManagementConnection(loop->vde_conn, client); }, NULL );
+}
+
+static void *packetHandlerThread(void *param) {
+	HandlerThread *thread = (HandlerThread *)param;
+	struct vde_wirefilter_conn *vde_conn = thread->vde_conn;
+	EventLoop *loop = &thread->loop;
+
+	EventHandler send_ring = { .fd=vde_conn->send_ring.eventfd, .callback=onSendRing };
+	EventHandler nested_data = { .fd=vde_datafd(vde_conn->conn), .callback=onNestedData };
+	EventHandler receive_space = { .fd=vde_conn->receive_ring.space_eventfd, .callback=onReceiveSpace, .arg=&nested_data };
+	EventHandler management = { .fd=vde_conn->management.socket_fd, .callback=onManagementSocket };
+	EventHandler blink_socket = { .fd=vde_conn->blink.socket_fd, .callback=onBlinkSocket };
+
+	// Only the events of the roles of this thread are registered, its deadlines share the timer of the loop
+	if (thread->roles & HANDLER_LR) {
+		loopAdd(loop, &send_ring, EPOLLIN | EPOLLET);
+		loopAttachTimer(loop, &vde_conn->queue.dir[LEFT_TO_RIGHT].timer, onQueueTimer, (void *)(intptr_t)LEFT_TO_RIGHT);
+		loopAttachTimer(loop, &vde_conn->speed_timer[LEFT_TO_RIGHT], onSendSpeedTimer, NULL);
+	}
+	if (thread->roles & HANDLER_RL) {
+		loopAdd(loop, &nested_data, EPOLLIN); // Level-triggered
+		loopAdd(loop, &receive_space, EPOLLIN);
+		loopAttachTimer(loop, &vde_conn->queue.dir[RIGHT_TO_LEFT].timer, onQueueTimer, (void *)(intptr_t)RIGHT_TO_LEFT);
+		loopAttachTimer(loop, &vde_conn->speed_timer[RIGHT_TO_LEFT], onSpeedTimer, &nested_data);
+	}
+	if (thread->roles & HANDLER_CONTROL) {
+		loopAttachTimer(loop, &vde_conn->markov.timer, onMarkovTimer, NULL);
+		if (vde_conn->management.socket_fd >= 0) { loopAdd(loop, &management, EPOLLIN); }
+
+		// Starts Markov timer
+		markovSetTimer(vde_conn, 1);
 
+		if (vde_conn->blink.socket_fd > 0) {
+			loopAttachTimer(loop, &vde_conn->blink.timer, onBlinkTimer, &blink_socket);
+			loopAdd(loop, &blink_socket, 0);
+			blinkSetTimer(&vde_conn->blink, 1);
 		}
 	}
 
-	pthread_exit(0);
+	loopRun(loop);
+
+	return NULL;
 }
 
 
-static void handlePacket(struct vde_wirefilter_conn *vde_conn, const Packet *packet) {
-	if (mtuHandler(vde_conn, packet) == DROP) { return; }
-	if (lossHandler(vde_conn, packet) == DROP) { return; }
+/* Applies the wire properties to a packet, the packet is owned (and eventually released) by the handler */
+static void handlePacket(struct vde_wirefilter_conn *vde_conn, Packet *packet) {
+	// The node can change only under the write lock, so the pipeline is stable for the whole packet
+	const Pipeline *pipeline = &MARKOV_CURRENT(vde_conn)->pipeline[packet->direction];
+	WireStats *stats = &vde_conn->stats[packet->direction];
+
+	stats->packets_in++;
+	stats->bytes_in += packet->len;
+
+	if (mtuHandler(vde_conn, pipeline, packet) == DROP) { goto exit; }
+	if (lossHandler(vde_conn, pipeline, packet) == DROP) { goto exit; }
 
 	double delay_ms = 0;
-	int send_times = 1 + duplicatesHandler(vde_conn, packet);
+	int send_times = 1 + duplicatesHandler(vde_conn, pipeline, packet);
+	stats->duplicates += send_times - 1;
 
 	for (int i=0; i<send_times; i++) {
-		Packet *to_send = packetCopy(packet);
+		// Duplicates share the payload of the original packet, which is sent last
+		Packet *to_send = (i == send_times-1) ? packet : packetClone(packet);
+		if (to_send == NULL) { STATS_DROP_ATOMIC(vde_conn, packet->direction, DROP_POOL); continue; }
 		delay_ms = 0;
 
-		if (bufferSizeHandler(vde_conn, to_send) == DROP) { return; }
+		if (bufferSizeHandler(vde_conn, pipeline, to_send) == DROP) {
+			if (to_send != packet) { packetDestroy(to_send); }
+			goto exit; 
+		}
 
-		delay_ms += speedHandler(vde_conn, to_send);
-		delay_ms += bandwidthHandler(vde_conn, to_send);
-		delay_ms += delayHandler(vde_conn, to_send);
+		delay_ms += speedHandler(vde_conn, pipeline, to_send);
+		delay_ms += bandwidthHandler(vde_conn, pipeline, to_send);
+		delay_ms += delayHandler(vde_conn, pipeline, to_send);
 
-		noiseHandler(vde_conn, to_send);
+		to_send = noiseHandler(vde_conn, pipeline, to_send);
+		if (to_send == NULL) { continue; }
 
-		if (delay_ms > 0 || (vde_conn->queue.fifoness == FIFO && vde_conn->queue.size > 0)) {
+		if (delay_ms > 0 || (vde_conn->queue.fifoness == FIFO && vde_conn->queue.dir[to_send->direction].size > 0)) {
 			enqueue(vde_conn, to_send, now_ns() + MS_TO_NS(delay_ms));
-			setQueueTimer(vde_conn);
+			setQueueTimer(vde_conn, to_send->direction);
 		}
 		else {
 			sendPacket(vde_conn, to_send);
 		}
 	}
+	return;
+
+	exit:
+		packetDestroy(packet);
 }
 
 
-/* Sends the packet to the correct destination */
+/* Sends the packet to the correct destination and releases it */
 static void sendPacket(struct vde_wirefilter_conn *vde_conn, Packet *packet) {
 	ssize_t rw_len;
 
-	// Blink message handling
-	if (vde_conn->blink.socket_fd) {
-		char *message_content = vde_conn->blink.message + (vde_conn->blink.id_len+1); // Skip id and blank
-		
-		snprintf(message_content, BLINK_MESSAGE_CONTENT_SIZE, "%s %ld\n",
-				(packet->direction == LEFT_TO_RIGHT) ? "LR" : ((packet->direction == RIGHT_TO_LEFT) ? "RL" : "--"), packet->len);		
-		sendto(vde_conn->blink.socket_fd, vde_conn->blink.message, strlen(vde_conn->blink.message), 0, 
-				(struct sockaddr *)&vde_conn->blink.socket_info, sizeof(vde_conn->blink.socket_info));
-	}
+	// Blink messages are sent in batches by the control thread
+	if (vde_conn->blink.socket_fd > 0) { blinkPacket(&vde_conn->blink, packet->direction, packet->len); }
 
 	if (packet->direction == LEFT_TO_RIGHT) {
 		rw_len = vde_send(vde_conn->conn, packet->buf, packet->len, packet->flags);
 		handle_error( rw_len < 0, {}, "Error while sending a LR packet");
+		if (rw_len >= 0) {
+			vde_conn->stats[LEFT_TO_RIGHT].packets_out++;
+			vde_conn->stats[LEFT_TO_RIGHT].bytes_out += packet->len;
+		}
 	}
 	else {
-		pthread_mutex_lock(&vde_conn->receive_lock);
-		// Makes the packet receivable
-		rw_len = write(vde_conn->receive_pipefd[1], packet->buf, packet->len);
-		handle_error( rw_len < 0, {}, "Error while sending a RL packet");
+		// Makes the packet receivable (the receiver releases it)
+		size_t len = packet->len;
+		if (ringPush(&vde_conn->receive_ring, packet) == 0) {
+			vde_conn->stats[RIGHT_TO_LEFT].packets_out++;
+			vde_conn->stats[RIGHT_TO_LEFT].bytes_out += len;
+			return;
+		}
+		// The receiver is not keeping up, the packet is discarded
+		STATS_DROP_ATOMIC(vde_conn, RIGHT_TO_LEFT, DROP_RING);
 	}
 
-	free(packet);
+	packetDestroy(packet);
 }
 
 
-static char mtuHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet) {
-	if (minWireValue(MARKOV_CURRENT(vde_conn), MTU, packet->direction) > 0 && 
-		packet->len > minWireValue(MARKOV_CURRENT(vde_conn), MTU, packet->direction)) {
+/* Value of an active stage, drawn from its stream if it has a random variation */
+#define STAGE_VALUE(vde_conn, pipeline, tag, direction) \
+	(((pipeline)->random & STAGE(tag)) ? sampleWireValue(&(pipeline)->value[(tag)], RANDOM_STREAM((vde_conn), (tag), (direction))) : (pipeline)->value[(tag)].value)
+
+static char mtuHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet) {
+	if ((pipeline->active & STAGE(MTU)) && packet->len > pipeline->mtu) {
+		STATS_DROP(vde_conn, packet->direction, DROP_MTU);
 		return DROP;
 	}
 
 	return FORWARD;
 }
 
-static char lossHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet) {
+static char lossHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet) {
 	// Total loss
-	if ( minWireValue(MARKOV_CURRENT(vde_conn), LOSS, packet->direction) >= 100.0 ) { return DROP; }
+	if (pipeline->total_loss) { STATS_DROP(vde_conn, packet->direction, DROP_LOSS); return DROP; }
 
-	if (maxWireValue(MARKOV_CURRENT(vde_conn), BURSTYLOSS, packet->direction) > 0) {
+	if (pipeline->active & STAGE(BURSTYLOSS)) {
 		// Loss with Gilbert model
-		double loss_val = computeWireValue(MARKOV_CURRENT(vde_conn), LOSS, packet->direction) / 100;
-		double burst_len = computeWireValue(MARKOV_CURRENT(vde_conn), BURSTYLOSS, packet->direction);
+		double enter_probability = pipeline->burst_enter;
+		double exit_probability = pipeline->burst_exit;
+
+		if (pipeline->random & (STAGE(LOSS) | STAGE(BURSTYLOSS))) {
+			double loss_val = sampleWireValue(&pipeline->value[LOSS], RANDOM_STREAM(vde_conn, LOSS, packet->direction)) / 100;
+			double burst_len = sampleWireValue(&pipeline->value[BURSTYLOSS], RANDOM_STREAM(vde_conn, BURSTYLOSS, packet->direction));
+			enter_probability = loss_val / (burst_len*(1-loss_val));
+			exit_probability = 1.0 / burst_len;
+		}
 
-		switch (vde_conn->bursty_loss_status[packet->direction]) {
+		switch (vde_conn->shaping[packet->direction].bursty_loss_status) {
 			case OK_BURST:
-				if ( drand48() < (loss_val / (burst_len*(1-loss_val))) ) { 
-					vde_conn->bursty_loss_status[packet->direction] = FAULTY_BURST; 
+				if ( randomUniform(RANDOM_STREAM(vde_conn, BURSTYLOSS, packet->direction)) < enter_probability ) { 
+					vde_conn->shaping[packet->direction].bursty_loss_status = FAULTY_BURST; 
 				}
 				break;
 			case FAULTY_BURST:
-				if ( drand48() < (1.0 / burst_len) ) { 
-					vde_conn->bursty_loss_status[packet->direction] = OK_BURST; 
+				if ( randomUniform(RANDOM_STREAM(vde_conn, BURSTYLOSS, packet->direction)) < exit_probability ) { 
+					vde_conn->shaping[packet->direction].bursty_loss_status = OK_BURST; 
 				}
 				break;
 		}
 
-		if (vde_conn->bursty_loss_status[packet->direction] != OK_BURST) { return DROP; }
+		if (vde_conn->shaping[packet->direction].bursty_loss_status != OK_BURST) {
+			STATS_DROP(vde_conn, packet->direction, DROP_BURSTYLOSS);
+			return DROP;
+		}
 	}
 	else {
-		vde_conn->bursty_loss_status[packet->direction] = OK_BURST;
+		vde_conn->shaping[packet->direction].bursty_loss_status = OK_BURST;
 		
 		// Standard loss handling
-		if (drand48() < (computeWireValue(MARKOV_CURRENT(vde_conn), LOSS, packet->direction) / 100)) {
-			return DROP;
+		if (pipeline->active & STAGE(LOSS)) {
+			double loss_probability = (pipeline->random & STAGE(LOSS)) ? 
+										STAGE_VALUE(vde_conn, pipeline, LOSS, packet->direction) / 100 : pipeline->constant[LOSS];
+
+			if (randomUniform(RANDOM_STREAM(vde_conn, LOSS, packet->direction)) < loss_probability) {
+				STATS_DROP(vde_conn, packet->direction, DROP_LOSS);
+				return DROP;
+			}
 		}
 	}
 
 	return FORWARD;
 }
 
-static int duplicatesHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet) {
+static int duplicatesHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet) {
 	int duplicate_times = 0;
 
-	if (maxWireValue(MARKOV_CURRENT(vde_conn), DUP, packet->direction) > 0) {
-		while (drand48() < (computeWireValue(MARKOV_CURRENT(vde_conn), DUP, packet->direction) / 100)) { 
-			duplicate_times++; 
-		}
+	if (pipeline->active & STAGE(DUP)) {
+		double dup_probability = (pipeline->random & STAGE(DUP)) ? 
+									STAGE_VALUE(vde_conn, pipeline, DUP, packet->direction) / 100 : pipeline->constant[DUP];
+
+		// Each copy is duplicated again with the same probability
+		duplicate_times = randomGeometric(RANDOM_STREAM(vde_conn, DUP, packet->direction), dup_probability, vde_conn->dup_max);
 	}
 
 	return duplicate_times;
 }
 
-static char bufferSizeHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet) {
-	if (maxWireValue(MARKOV_CURRENT(vde_conn), CHANBUFSIZE, packet->direction)) {
-		double buffer_max_size = computeWireValue(MARKOV_CURRENT(vde_conn), CHANBUFSIZE, packet->direction);
+static char bufferSizeHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet) {
+	if (pipeline->active & STAGE(CHANBUFSIZE)) {
+		double buffer_max_size = STAGE_VALUE(vde_conn, pipeline, CHANBUFSIZE, packet->direction);
 		
-		if ((vde_conn->queue.byte_size[packet->direction] + packet->len) > buffer_max_size) {
+		if ((vde_conn->queue.dir[packet->direction].byte_size + packet->len) > buffer_max_size) {
+			STATS_DROP(vde_conn, packet->direction, DROP_CHANBUFSIZE);
 			return DROP;
 		}
 	}
@@ -556,56 +771,66 @@ static char bufferSizeHandler(struct vde_wirefilter_conn *vde_conn, const Packet
 	return FORWARD;
 }
 
-static double bandwidthHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet) {
+static double bandwidthHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet) {
 	double delay_ms = 0;
 
-	if (maxWireValue(MARKOV_CURRENT(vde_conn), BANDWIDTH, packet->direction) > 0) {
-		double bandwidth = computeWireValue(MARKOV_CURRENT(vde_conn), BANDWIDTH, packet->direction);
-		if (bandwidth <= 0) { return DROP; }
+	if (pipeline->active & STAGE(BANDWIDTH)) {
+		double ms_per_byte = pipeline->constant[BANDWIDTH];
+
+		if (pipeline->random & STAGE(BANDWIDTH)) {
+			double bandwidth = STAGE_VALUE(vde_conn, pipeline, BANDWIDTH, packet->direction);
+			if (bandwidth <= 0) { return DROP; }
+			ms_per_byte = 1000 / bandwidth;
+		}
 
-		double send_time_ms = (packet->len*1000) / bandwidth;
+		double send_time_ms = packet->len * ms_per_byte;
 		uint64_t now = now_ns();
 
-		if (now > vde_conn->bandwidth_next[packet->direction]) {
+		if (now > vde_conn->shaping[packet->direction].bandwidth_next) {
 			// Bandwidth is still below the limit, delay this one to keep the bandwidth up to the limit
-			vde_conn->bandwidth_next[packet->direction] = now;
+			vde_conn->shaping[packet->direction].bandwidth_next = now;
 			delay_ms = send_time_ms;
 		} else {
 			// Bandwidth is overflowing, delay this one until the next bandwidth timestamp 
-			double diff = NS_TO_MS( vde_conn->bandwidth_next[packet->direction] - now );
+			double diff = NS_TO_MS( vde_conn->shaping[packet->direction].bandwidth_next - now );
 			delay_ms = diff + send_time_ms;
 		}
-		vde_conn->bandwidth_next[packet->direction] += MS_TO_NS(send_time_ms);
+		vde_conn->shaping[packet->direction].bandwidth_next += MS_TO_NS(send_time_ms);
 	}
 
 	return delay_ms;
 }
 
-static double speedHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet) {
+static double speedHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet) {
 	double delay_ms = 0;
 
-	if (maxWireValue(MARKOV_CURRENT(vde_conn), SPEED, packet->direction) > 0) {
-		double speed = computeWireValue(MARKOV_CURRENT(vde_conn), SPEED, packet->direction);
-		if (speed <= 0) { return DROP; };
+	if (pipeline->active & STAGE(SPEED)) {
+		double ms_per_byte = pipeline->constant[SPEED];
 
-		double send_time_ms = (packet->len*1000) / speed;
+		if (pipeline->random & STAGE(SPEED)) {
+			double speed = STAGE_VALUE(vde_conn, pipeline, SPEED, packet->direction);
+			if (speed <= 0) { return DROP; };
+			ms_per_byte = 1000 / speed;
+		}
+
+		double send_time_ms = packet->len * ms_per_byte;
 		uint64_t now = now_ns();
 
 		delay_ms = send_time_ms;
-		if (now > vde_conn->speed_next[packet->direction]) {
-			vde_conn->speed_next[packet->direction] = now;
+		if (now > vde_conn->shaping[packet->direction].speed_next) {
+			vde_conn->shaping[packet->direction].speed_next = now;
 		}
-		vde_conn->speed_next[packet->direction] += MS_TO_NS(send_time_ms);
+		vde_conn->shaping[packet->direction].speed_next += MS_TO_NS(send_time_ms);
 	}
 
 	return delay_ms;
 }
 
-static double delayHandler(struct vde_wirefilter_conn *vde_conn, const Packet *packet) {
+static double delayHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, const Packet *packet) {
 	double delay_ms = 0;
 
-	if (maxWireValue(MARKOV_CURRENT(vde_conn), DELAY, packet->direction) > 0) {
-		double delay_value = computeWireValue(MARKOV_CURRENT(vde_conn), DELAY, packet->direction);
+	if (pipeline->active & STAGE(DELAY)) {
+		double delay_value = STAGE_VALUE(vde_conn, pipeline, DELAY, packet->direction);
 
 		if (delay_value > 0) {
 			delay_ms = delay_value;
@@ -615,18 +840,34 @@ static double delayHandler(struct vde_wirefilter_conn *vde_conn, const Packet *p
 	return delay_ms;
 }
 
-static Packet *noiseHandler(struct vde_wirefilter_conn *vde_conn, Packet *packet) {
-	if (maxWireValue(MARKOV_CURRENT(vde_conn), NOISE, packet->direction) > 0) {
-		double noise = computeWireValue(MARKOV_CURRENT(vde_conn), NOISE, packet->direction);
-		int broken_bits = 0;
-		
-		// Determines the number of broken bits
-		while ((drand48()*8*MEGA) < (packet->len-2)*8*noise) { broken_bits++; }
+/* Returns the packet to send (a private copy if the payload had to be modified), NULL if the packet has been dropped */
+static Packet *noiseHandler(struct vde_wirefilter_conn *vde_conn, const Pipeline *pipeline, Packet *packet) {
+	if (pipeline->active & STAGE(NOISE)) {
+		Random *rng = RANDOM_STREAM(vde_conn, NOISE, packet->direction);
+		double bit_probability = (pipeline->random & STAGE(NOISE)) ? 
+									NOISE_BIT_PROBABILITY(STAGE_VALUE(vde_conn, pipeline, NOISE, packet->direction)) : pipeline->constant[NOISE];
+		uint32_t bits = packet->len * 8;
+
+		// Each bit is broken independently
+		unsigned int broken_bits = randomBinomial(rng, bits, bit_probability);
+		if (broken_bits == 0) { return packet; }
+
+		// The payload may be shared with duplicates
+		int direction = packet->direction;
+		packet = packetMakeWritable(packet);
+		if (packet == NULL) { STATS_DROP_ATOMIC(vde_conn, direction, DROP_POOL); return NULL; }
+		vde_conn->stats[direction].flipped_bits += broken_bits;
 		
 		// Breaks the packet
-		for (int i=0; i<broken_bits; i++) {
-			int to_flip_bit = drand48() * packet->len*8;
-			((char*)packet->buf)[(to_flip_bit >> 3) + 2] ^= 1<<(to_flip_bit & 0x7);
+		uint32_t to_flip[NOISE_FLIP_BATCH];
+		while (broken_bits > 0) {
+			unsigned int count = (broken_bits < NOISE_FLIP_BATCH) ? broken_bits : NOISE_FLIP_BATCH;
+			randomIndexes(rng, to_flip, count, bits);
+
+			for (unsigned int i=0; i<count; i++) {
+				((unsigned char *)packet->buf)[to_flip[i] >> 3] ^= 1 << (to_flip[i] & 0x7);
+			}
+			broken_bits -= count;
 		}
 	} 
 
@@ -634,36 +875,6 @@ static Packet *noiseHandler(struct vde_wirefilter_conn *vde_conn, Packet *packet
 }
 
 
-static int openBlinkSocket(struct vde_wirefilter_conn *vde_conn, char *socket_path) {
-	vde_conn->blink.socket_info.sun_family = PF_UNIX;
-	strncpy(vde_conn->blink.socket_info.sun_path, socket_path, sizeof(vde_conn->blink.socket_info.sun_path)-1);
-
-	vde_conn->blink.socket_fd = socket(PF_UNIX, SOCK_DGRAM, 0);
-	handle_error( vde_conn->blink.socket_fd == -1, { return -1; }, "Blink socket error: %s", strerror(errno) );
-
-	return 0;
-}
-
-static int setBlinkId(struct vde_wirefilter_conn *vde_conn, char *id) {
-	char pid_str[6+1];
-	char *to_set_id = id;
-
-	// If id is not set, defaults to pid
-	if (to_set_id == NULL) {
-		snprintf(pid_str, sizeof(pid_str), "%06d", getpid());
-		to_set_id = pid_str;
-	}
-
-	vde_conn->blink.id_len = strlen(to_set_id);
-	return asprintf(&vde_conn->blink.message, "%s %*c", to_set_id, BLINK_MESSAGE_CONTENT_SIZE, ' ');
-}
-
-static void closeBlink(struct vde_wirefilter_conn *vde_conn) {
-	close(vde_conn->blink.socket_fd);
-	remove(vde_conn->blink.socket_info.sun_path);
-}
-
-
 static int savePidFile(char *path) {
 	FILE *fout = NULL;
 	